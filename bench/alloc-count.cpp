@@ -0,0 +1,88 @@
+/*
+ File:      alloc-count.cpp
+
+ Purpose:   Counts the heap allocations of a process, preloaded into it
+            with LD_PRELOAD. Every malloc, calloc, realloc and aligned
+            allocation, including those behind operator new, is counted
+            and the total is written to stderr at exit, as
+            "allocations: N". Allocations are forwarded to the glibc
+            implementation, so this only works with glibc.
+
+ Copyright:
+            Licensed under the Apache License, Version 2.0 (the "License");
+            you may not use this file except in compliance with the License.
+            You may obtain a copy of the License at
+
+            http://www.apache.org/licenses/LICENSE-2.0
+
+            Unless required by applicable law or agreed to in writing, software
+            distributed under the License is distributed on an "AS IS" BASIS,
+            WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+            implied. See the License for the specific language governing
+            permissions and limitations under the License.
+
+ Usage:
+            LD_PRELOAD=bench/alloc-count.so COMMAND...
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <atomic>
+using namespace std;
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* p, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+}
+
+static atomic<unsigned long> allocations(0);
+
+extern "C" void* malloc(size_t size)
+{
+    allocations++;
+    return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size)
+{
+    allocations++;
+    return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* p, size_t size)
+{
+    allocations++;
+    return __libc_realloc(p, size);
+}
+
+extern "C" void* memalign(size_t alignment, size_t size)
+{
+    allocations++;
+    return __libc_memalign(alignment, size);
+}
+
+extern "C" void* aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+extern "C" int posix_memalign(void** p, size_t alignment, size_t size)
+{
+    void* block = memalign(alignment, size);
+    if (!block)
+        return ENOMEM;
+    *p = block;
+    return 0;
+}
+
+__attribute__((destructor)) static void report()
+{
+    char line[64];
+    int size = snprintf(line, sizeof(line), "allocations: %lu\n", allocations.load());
+    if (write(STDERR_FILENO, line, size) < 0)
+        _exit(1);
+}
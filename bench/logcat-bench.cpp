@@ -0,0 +1,213 @@
+/*
+ File:      logcat-bench.cpp
+
+ Purpose:   Measures logcat-colorize on synthetic logs produced by
+            logcat-gen: lines/sec, MB/sec and peak RSS, for each format
+            and for the default, --spotlight and --ignore modes. The
+            parse-only case drops every record after parsing, so the
+            difference with the default case is the rendering cost. The
+            json case renders the same records as NDJSON instead, and the
+            generic case takes the virtual per-line path of mixed streams
+            rather than the loop specialized for the detected format. The
+            piped cases feed the log through a pipe, as adb does, instead
+            of a redirected file, which is mapped.
+
+ Copyright:
+            Licensed under the Apache License, Version 2.0 (the "License");
+            you may not use this file except in compliance with the License.
+            You may obtain a copy of the License at
+
+            http://www.apache.org/licenses/LICENSE-2.0
+
+            Unless required by applicable law or agreed to in writing, software
+            distributed under the License is distributed on an "AS IS" BASIS,
+            WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+            implied. See the License for the specific language governing
+            permissions and limitations under the License.
+
+ Usage:
+            logcat-bench EXEC GEN [LINES] [UNMATCHED] [RUNS] [-- EXTRA OPTIONS]
+
+            Every case runs RUNS times (default 3); the fastest run is
+            reported. EXTRA OPTIONS are passed to every EXEC run.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <vector>
+using namespace std;
+
+const int SUCCESS = 0;
+const int ERROR_USAGE = 1;
+const int ERROR_UNKNOWN = 2;
+
+struct Run {
+    double seconds;
+    long maxRssKb;
+};
+
+// Copies the file at path to fd.
+void feed(const string& path, int fd)
+{
+    int in = open(path.c_str(), O_RDONLY);
+    if (in < 0)
+        return;
+    char buffer[64*1024];
+    ssize_t count;
+    while ((count = read(in, buffer, sizeof(buffer))) > 0)
+        for (ssize_t written = 0, n; written < count; written += n)
+            if ((n = write(fd, buffer + written, count - written)) < 0)
+                return;
+}
+
+// Runs argv with the given stdin and stdout, returning wall time and peak RSS.
+// A piped input is fed by another process, as from adb, rather than mapped.
+Run run(const vector<string>& args, const string& input, const string& output, bool piped = false)
+{
+    vector<char*> argv;
+    for (const string& arg : args)
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(nullptr);
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid < 0)
+        throw runtime_error(string("cannot fork: ") + strerror(errno));
+    if (pid == 0) {
+        int in = -1;
+        if (piped) {
+            int ends[2];
+            if (pipe(ends) < 0)
+                _exit(127);
+            pid_t feeder = fork();
+            if (feeder < 0)
+                _exit(127);
+            if (feeder == 0) {
+                close(ends[0]);
+                feed(input, ends[1]);
+                _exit(0);
+            }
+            close(ends[1]);
+            in = ends[0];
+        }
+        else
+            in = open(input.c_str(), O_RDONLY);
+        int out = open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (in < 0 || out < 0 || dup2(in, STDIN_FILENO) < 0 || dup2(out, STDOUT_FILENO) < 0)
+            _exit(127);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0)
+        throw runtime_error(string("cannot wait: ") + strerror(errno));
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        throw runtime_error("command failed: " + args[0]);
+
+    Run result;
+    result.seconds = elapsed.count();
+#ifdef __APPLE__
+    result.maxRssKb = usage.ru_maxrss/1024;
+#else
+    result.maxRssKb = usage.ru_maxrss;
+#endif
+    return result;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s EXEC GEN [LINES] [UNMATCHED] [RUNS] [-- EXTRA OPTIONS]\n", argv[0]);
+        return ERROR_USAGE;
+    }
+
+    vector<string> positional;
+    vector<string> extra;
+    for (int i = 1; i < argc; i++) {
+        if (string(argv[i]) == "--") {
+            extra.assign(argv + i + 1, argv + argc);
+            break;
+        }
+        positional.push_back(argv[i]);
+    }
+    const string exec = positional[0];
+    const string gen = positional[1];
+    const string lines = positional.size() > 2 ? positional[2] : "500000";
+    const string unmatched = positional.size() > 3 ? positional[3] : "0.05";
+    const int runs = positional.size() > 4 ? max(1, atoi(positional[4].c_str())) : 3;
+
+    const char* formats[] = { "tag", "process", "brief", "time", "threadtime", "long" };
+    const struct {
+        const char* name;
+        vector<string> options;
+        bool piped;
+    } cases[] = {
+        { "default", {}, false },
+        { "spotlight", { "-s", "Wifi\\w*", "-s", "\\bdenied\\b" }, false },
+        { "ignore", { "-i" }, false },
+        { "parse-only", { "-i", "-F", "level>F" }, false },
+        { "json", { "-o", "json" }, false },
+        { "generic", { "--generic" }, false },
+        { "piped", {}, true },
+        { "piped-generic", { "--generic" }, true }
+    };
+
+    char input[] = "/tmp/logcat-bench-XXXXXX";
+    int fd = mkstemp(input);
+    if (fd < 0) {
+        perror("mkstemp");
+        return ERROR_UNKNOWN;
+    }
+    close(fd);
+
+    try {
+        printf("%-11s %-13s %10s %14s %10s %10s\n",
+               "format", "mode", "seconds", "lines/sec", "MB/sec", "RSS (MB)");
+        for (const char* format : formats) {
+            run({ gen, format, lines, unmatched }, "/dev/null", input);
+            struct stat info;
+            stat(input, &info);
+            const double megabytes = info.st_size/(1024.0*1024.0);
+
+            for (const auto& c : cases) {
+                vector<string> args = { exec };
+                args.insert(args.end(), c.options.begin(), c.options.end());
+                args.insert(args.end(), extra.begin(), extra.end());
+
+                Run best = { 0, 0 };
+                for (int i = 0; i < runs; i++) {
+                    Run current = run(args, input, "/dev/null", c.piped);
+                    if (!i || current.seconds < best.seconds)
+                        best.seconds = current.seconds;
+                    best.maxRssKb = max(best.maxRssKb, current.maxRssKb);
+                }
+                printf("%-11s %-13s %10.3f %14.0f %10.1f %10.1f\n",
+                       format, c.name, best.seconds, atof(lines.c_str())/best.seconds,
+                       megabytes/best.seconds, best.maxRssKb/1024.0);
+                fflush(stdout);
+            }
+        }
+    }
+    catch (exception& e) {
+        fprintf(stderr, "Error: %s\n", e.what());
+        unlink(input);
+        return ERROR_UNKNOWN;
+    }
+
+    unlink(input);
+    return SUCCESS;
+}
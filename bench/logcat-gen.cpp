@@ -0,0 +1,258 @@
+/*
+ File:      logcat-gen.cpp
+
+ Purpose:   Generates synthetic logcat output for benchmarking
+            logcat-colorize. The output only depends on the arguments.
+
+ Copyright:
+            Licensed under the Apache License, Version 2.0 (the "License");
+            you may not use this file except in compliance with the License.
+            You may obtain a copy of the License at
+
+            http://www.apache.org/licenses/LICENSE-2.0
+
+            Unless required by applicable law or agreed to in writing, software
+            distributed under the License is distributed on an "AS IS" BASIS,
+            WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+            implied. See the License for the specific language governing
+            permissions and limitations under the License.
+
+ Usage:
+            logcat-gen FORMAT LINES [UNMATCHED] [SEED]
+
+            FORMAT is one of tag, process, brief, time, threadtime, long;
+            for long, LINES counts entries, some spanning two message lines.
+            UNMATCHED is the fraction of lines not in FORMAT (default 0.05).
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+using namespace std;
+
+const int SUCCESS = 0;
+const int ERROR_USAGE = 1;
+
+/*
+ xorshift64*: small, fast and, unlike the standard distributions, gives the
+ same sequence with every standard library.
+*/
+class Random
+{
+public:
+    Random(uint64_t seed) : m_state(seed ? seed : 0x9E3779B97F4A7C15ULL) {}
+
+    uint64_t next() {
+        m_state ^= m_state >> 12;
+        m_state ^= m_state << 25;
+        m_state ^= m_state >> 27;
+        return m_state * 0x2545F4914F6CDD1DULL;
+    }
+
+    // Uniform in [0, 1).
+    double real() { return (next() >> 11) * (1.0/9007199254740992.0); }
+
+    // Uniform in [low, high].
+    int range(int low, int high) { return low + static_cast<int>(next() % (high - low + 1)); }
+
+    // Index drawn from cumulative weights.
+    size_t pick(const vector<double>& cumulative) {
+        double value = real()*cumulative.back();
+        size_t i = 0;
+        while (i + 1 < cumulative.size() && cumulative[i] <= value)
+            i++;
+        return i;
+    }
+
+private:
+    uint64_t m_state;
+};
+
+// A few tags are very chatty, most are rare: weight 1/rank.
+const char* const TAGS[] = {
+    "ActivityManager", "WindowManager", "chatty", "PackageManager", "InputDispatcher",
+    "WifiService", "SurfaceFlinger", "art", "libc", "System.err", "AudioFlinger",
+    "ConnectivityService", "BluetoothAdapter", "GnssLocationProvider", "NetworkController",
+    "OpenGLRenderer", "Zygote", "dex2oat", "Choreographer", "AndroidRuntime",
+    "ViewRootImpl[MainActivity]", "cr_ChildProcessConn", "BatteryStatsService",
+    "JobScheduler", "SyncManager", "vold", "netd", "DHCP", "Camera2ClientBase",
+    "MediaCodec", "ExoPlayerImpl", "okhttp.OkHttpClient"
+};
+
+const char* const WORDS[] = {
+    "Start", "proc", "activity", "service", "for", "broadcast", "intent", "com.android.systemui",
+    "com.example.app/.MainActivity", "pid=", "uid", "u0a123", "failed", "to", "connect", "null",
+    "Exception", "at", "the", "window", "focus", "changed", "Displayed", "+312ms", "Skipped",
+    "frames!", "The", "application", "may", "be", "doing", "too", "much", "work", "on", "its",
+    "main", "thread.", "wlan0", "RSSI", "-67", "dBm", "state", "CONNECTED", "timeout", "after",
+    "5000ms", "Access", "denied", "finding", "property", "0x7f0a0012", "GC", "freed", "12MB",
+    "AllocSpace", "objects", "paused", "total", "(", ")", "[", "]", ":", "="
+};
+
+const char LEVELS[] = { 'V', 'D', 'I', 'W', 'E', 'F' };
+const double LEVEL_WEIGHTS[] = { 5, 35, 40, 12, 7, 1 };
+
+template<typename T, size_t N>
+size_t count(const T (&)[N]) { return N; }
+
+vector<double> cumulative(const double* weights, size_t size)
+{
+    vector<double> out;
+    double total = 0;
+    for (size_t i = 0; i < size; i++)
+        out.push_back(total += weights[i]);
+    return out;
+}
+
+// Messages are mostly short with a long tail, roughly log-normal.
+void appendMessage(string& line, Random& random)
+{
+    double length = 1;
+    for (int i = 0; i < 4; i++)
+        length *= 0.6 + random.real()*1.4;
+    int words = 1 + static_cast<int>(length*6);
+    for (int i = 0; i < words; i++) {
+        if (i)
+            line += ' ';
+        line += WORDS[random.next() % count(WORDS)];
+    }
+}
+
+void appendDate(string& line, uint64_t millis)
+{
+    char date[32];
+    uint64_t seconds = millis/1000;
+    snprintf(date, sizeof(date), "%02d-%02d %02d:%02d:%02d.%03d",
+             3, 14, static_cast<int>(seconds/3600 % 24), static_cast<int>(seconds/60 % 60),
+             static_cast<int>(seconds % 60), static_cast<int>(millis % 1000));
+    line += date;
+}
+
+// Lines adb prints which are in no format: markers and stack trace lines.
+void appendUnmatched(string& line, Random& random)
+{
+    switch (random.range(0, 3)) {
+    case 0:
+        line += "--------- beginning of main";
+        break;
+    case 1:
+        line += "\tat com.example.app.MainActivity.onCreate(MainActivity.java:";
+        line += to_string(random.range(10, 900));
+        line += ")";
+        break;
+    default:
+        line += "    ";
+        appendMessage(line, random);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s FORMAT LINES [UNMATCHED] [SEED]\n", argv[0]);
+        return ERROR_USAGE;
+    }
+    const string format = argv[1];
+    if (format != "tag" && format != "process" && format != "brief" &&
+            format != "time" && format != "threadtime" && format != "long") {
+        fprintf(stderr, "Unknown format: %s\n", format.c_str());
+        return ERROR_USAGE;
+    }
+    const long lines = atol(argv[2]);
+    const double unmatched = argc > 3 ? atof(argv[3]) : 0.05;
+    Random random(argc > 4 ? strtoull(argv[4], nullptr, 10) : 1);
+
+    vector<double> tagWeights;
+    for (size_t i = 0; i < count(TAGS); i++)
+        tagWeights.push_back(1.0/(i + 1));
+    const vector<double> tags = cumulative(tagWeights.data(), tagWeights.size());
+    const vector<double> levels = cumulative(LEVEL_WEIGHTS, count(LEVEL_WEIGHTS));
+
+    // A few processes with a few threads each.
+    vector<int> pids;
+    for (int i = 0; i < 24; i++)
+        pids.push_back(random.range(100, 32000));
+
+    string line;
+    uint64_t millis = 0;
+    for (long i = 0; i < lines; i++) {
+        line.clear();
+        millis += random.range(0, 40);
+
+        if (random.real() < unmatched) {
+            appendUnmatched(line, random);
+            line += '\n';
+            fwrite(line.data(), 1, line.size(), stdout);
+            continue;
+        }
+
+        const char level = LEVELS[random.pick(levels)];
+        const char* tag = TAGS[random.pick(tags)];
+        const int pid = pids[random.next() % pids.size()];
+        const int tid = random.real() < 0.4 ? pid : pid + random.range(1, 60);
+        char buffer[64];
+
+        if (format == "threadtime") {
+            appendDate(line, millis);
+            snprintf(buffer, sizeof(buffer), " %5d %5d %c ", pid, tid, level);
+            line += buffer;
+            line += tag;
+            line += ": ";
+            appendMessage(line, random);
+        }
+        else if (format == "long") {
+            line += "[ ";
+            appendDate(line, millis);
+            snprintf(buffer, sizeof(buffer), " %5d:%5d %c/", pid, tid, level);
+            line += buffer;
+            line += tag;
+            if (strlen(tag) < 8)
+                line.append(8 - strlen(tag), ' ');
+            line += " ]\n";
+            appendMessage(line, random);
+            if (random.real() < 0.1) {
+                line += '\n';
+                appendMessage(line, random);
+            }
+            line += '\n';
+        }
+        else if (format == "time") {
+            appendDate(line, millis);
+            snprintf(buffer, sizeof(buffer), " %c/", level);
+            line += buffer;
+            line += tag;
+            snprintf(buffer, sizeof(buffer), "(%5d): ", pid);
+            line += buffer;
+            appendMessage(line, random);
+        }
+        else if (format == "brief") {
+            line += level;
+            line += '/';
+            line += tag;
+            snprintf(buffer, sizeof(buffer), "(%5d): ", pid);
+            line += buffer;
+            appendMessage(line, random);
+        }
+        else if (format == "process") {
+            snprintf(buffer, sizeof(buffer), "%c(%5d) ", level, pid);
+            line += buffer;
+            appendMessage(line, random);
+            line += "  (";
+            line += tag;
+            line += ")";
+        }
+        else {
+            line += level;
+            line += '/';
+            line += tag;
+            line += ": ";
+            appendMessage(line, random);
+        }
+        line += '\n';
+        fwrite(line.data(), 1, line.size(), stdout);
+    }
+    return SUCCESS;
+}
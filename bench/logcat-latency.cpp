@@ -0,0 +1,236 @@
+/*
+ File:      logcat-latency.cpp
+
+ Purpose:   Measures how soon logcat-colorize shows the lines of a live
+            input and how many system calls it makes per line. Lines are
+            written to its stdin through a pipe the way adb does, one write
+            each: a trickle of lines far apart, then a burst of lines at a
+            high rate, several times over. Every line carries a sequence
+            number, found back in the output to time it from its write to
+            its arrival. Read and write calls come from --stats.
+
+ Copyright:
+            Licensed under the Apache License, Version 2.0 (the "License");
+            you may not use this file except in compliance with the License.
+            You may obtain a copy of the License at
+
+            http://www.apache.org/licenses/LICENSE-2.0
+
+            Unless required by applicable law or agreed to in writing, software
+            distributed under the License is distributed on an "AS IS" BASIS,
+            WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+            implied. See the License for the specific language governing
+            permissions and limitations under the License.
+
+ Usage:
+            logcat-latency EXEC [ROUNDS] [BURST_LINES] [BURST_RATE] [-- EXTRA OPTIONS]
+
+            Each round is 20 lines 50 ms apart, then BURST_LINES lines
+            (default 5000) at BURST_RATE lines/sec (default 10000); ROUNDS
+            defaults to 3. EXTRA OPTIONS are passed to every EXEC run.
+*/
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+
+const int SUCCESS = 0;
+const int ERROR_USAGE = 1;
+const int ERROR_UNKNOWN = 2;
+
+const int TRICKLE_LINES = 20;
+const int TRICKLE_GAP_MS = 50;
+
+typedef chrono::steady_clock Clock;
+
+struct Result {
+    vector<double> trickle;
+    vector<double> burst;
+    double readsPerLine;
+    double writesPerLine;
+};
+
+// The "in N calls" count of a line of the --stats report.
+long calls(const string& report, const string& stage)
+{
+    size_t at = report.find(stage + ":");
+    if (at == string::npos || (at = report.find(" in ", at)) == string::npos)
+        throw runtime_error("no " + stage + " calls in the --stats report");
+    return atol(report.c_str() + at + 4);
+}
+
+// Runs argv, feeding it rounds of a trickle then a burst of lines.
+Result run(const vector<string>& args, int rounds, int burstLines, int burstRate)
+{
+    vector<char*> argv;
+    for (const string& arg : args)
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(nullptr);
+
+    int in[2], out[2], err[2];
+    if (pipe(in) < 0 || pipe(out) < 0 || pipe(err) < 0)
+        throw runtime_error(string("cannot create pipes: ") + strerror(errno));
+    pid_t pid = fork();
+    if (pid < 0)
+        throw runtime_error(string("cannot fork: ") + strerror(errno));
+    if (pid == 0) {
+        if (dup2(in[0], STDIN_FILENO) < 0 || dup2(out[1], STDOUT_FILENO) < 0 ||
+                dup2(err[1], STDERR_FILENO) < 0)
+            _exit(127);
+        for (int fd : { in[0], in[1], out[0], out[1], err[0], err[1] })
+            close(fd);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    close(err[1]);
+
+    const int perRound = TRICKLE_LINES + burstLines;
+    const int total = rounds*perRound;
+    vector<Clock::time_point> sent(total), received(total);
+
+    thread writer([&]() {
+        char line[160];
+        const chrono::nanoseconds gap(1000000000LL/burstRate);
+        Clock::time_point due = Clock::now();
+        for (int i = 0; i < total; i++) {
+            bool trickle = i % perRound < TRICKLE_LINES;
+            if (trickle) {
+                this_thread::sleep_for(chrono::milliseconds(TRICKLE_GAP_MS));
+                due = Clock::now();
+            }
+            else {
+                due += gap;
+                this_thread::sleep_until(due);
+            }
+            int size = snprintf(line, sizeof(line),
+                                "03-14 00:00:%02d.%03d  1234  1234 %c Latency: seq=%d of a live line\n",
+                                i/1000 % 60, i % 1000, trickle ? 'I' : 'D', i);
+            sent[i] = Clock::now();
+            if (write(in[1], line, size) != size)
+                break;
+        }
+        close(in[1]);
+    });
+
+    // Lines arrive whole, but possibly split over several reads.
+    string pending;
+    char buffer[64*1024];
+    ssize_t count;
+    while ((count = read(out[0], buffer, sizeof(buffer))) != 0) {
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        Clock::time_point now = Clock::now();
+        pending.append(buffer, count);
+        size_t eol, begin = 0;
+        while ((eol = pending.find('\n', begin)) != string::npos) {
+            size_t seq = pending.find("seq=", begin);
+            if (seq < eol) {
+                int i = atoi(pending.c_str() + seq + 4);
+                if (i >= 0 && i < total)
+                    received[i] = now;
+            }
+            begin = eol + 1;
+        }
+        pending.erase(0, begin);
+    }
+    writer.join();
+    close(out[0]);
+
+    string report;
+    while ((count = read(err[0], buffer, sizeof(buffer))) > 0)
+        report.append(buffer, count);
+    close(err[0]);
+    int status;
+    if (waitpid(pid, &status, 0) < 0)
+        throw runtime_error(string("cannot wait: ") + strerror(errno));
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        throw runtime_error("command failed: " + args[0]);
+
+    Result result;
+    for (int i = 0; i < total; i++) {
+        if (received[i] == Clock::time_point())
+            throw runtime_error("line " + to_string(i) + " is missing from the output");
+        double ms = chrono::duration<double, milli>(received[i] - sent[i]).count();
+        (i % perRound < TRICKLE_LINES ? result.trickle : result.burst).push_back(ms);
+    }
+    result.readsPerLine = static_cast<double>(calls(report, "read"))/total;
+    result.writesPerLine = static_cast<double>(calls(report, "write"))/total;
+    return result;
+}
+
+// p50, p99 and max, in ms.
+string percentiles(vector<double> latencies)
+{
+    sort(latencies.begin(), latencies.end());
+    auto at = [&](double p) { return latencies[min(latencies.size() - 1, static_cast<size_t>(p*latencies.size()))]; };
+    char text[64];
+    snprintf(text, sizeof(text), "%7.2f %7.2f %7.2f", at(0.5), at(0.99), latencies.back());
+    return text;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s EXEC [ROUNDS] [BURST_LINES] [BURST_RATE] [-- EXTRA OPTIONS]\n", argv[0]);
+        return ERROR_USAGE;
+    }
+
+    vector<string> positional;
+    vector<string> extra;
+    for (int i = 1; i < argc; i++) {
+        if (string(argv[i]) == "--") {
+            extra.assign(argv + i + 1, argv + argc);
+            break;
+        }
+        positional.push_back(argv[i]);
+    }
+    const string exec = positional[0];
+    const int rounds = positional.size() > 1 ? max(1, atoi(positional[1].c_str())) : 3;
+    const int burstLines = positional.size() > 2 ? max(1, atoi(positional[2].c_str())) : 5000;
+    const int burstRate = positional.size() > 3 ? max(1, atoi(positional[3].c_str())) : 10000;
+
+    const struct {
+        const char* name;
+        vector<string> options;
+    } cases[] = {
+        { "adaptive", {} },
+        { "drained", { "--max-latency", "0" } },
+        { "line", { "--line-buffered" } }
+    };
+
+    signal(SIGPIPE, SIG_IGN);
+    try {
+        printf("%-10s %-23s %-23s %10s %10s\n", "mode", "trickle p50/p99/max ms",
+               "burst p50/p99/max ms", "reads/line", "writes/line");
+        for (const auto& c : cases) {
+            vector<string> args = { exec, "--stats" };
+            args.insert(args.end(), c.options.begin(), c.options.end());
+            args.insert(args.end(), extra.begin(), extra.end());
+            Result result = run(args, rounds, burstLines, burstRate);
+            printf("%-10s %-23s %-23s %10.3f %10.3f\n", c.name, percentiles(result.trickle).c_str(),
+                   percentiles(result.burst).c_str(), result.readsPerLine, result.writesPerLine);
+            fflush(stdout);
+        }
+    }
+    catch (exception& e) {
+        fprintf(stderr, "Error: %s\n", e.what());
+        return ERROR_UNKNOWN;
+    }
+    return SUCCESS;
+}
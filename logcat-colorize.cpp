@@ -35,13 +35,44 @@
 */
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <zlib.h>
+#ifdef LOGCAT_COLORIZE_ZSTD
+#include <zstd.h>
+#endif
+#include <poll.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 #include <string>
+#include <string_view>
 #include <iostream>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <unordered_map>
+#include <array>
+#include <type_traits>
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
 #include <boost/regex.hpp>
 #include <boost/program_options.hpp>
 #include <boost/algorithm/string.hpp>
-#include <boost/format.hpp>
 #include <boost/optional.hpp>
 using namespace std;
 
@@ -50,23 +81,85 @@ const string VERSION = "0.10.1";
 
 const int SUCCESS = 0;
 const int ERROR_UNKNOWN = 1;
+const int ERROR_VERIFY = 2;
 
 const string HELP = 
     NAME + " v" + VERSION + "\n"
     "\n"
     "A simple script to colorize Android debugger's logcat output.\n"
     "To use this, you MUST pipe from adb output. See examples below.\n"
-    "Valid ONLY for Tag, Process, Brief, Time and ThreadTime formats.\n"
-    "Other formats are simply not parsed here.\n"
+    "Valid ONLY for Tag, Process, Brief, Time, ThreadTime and Long formats.\n"
+    "Other formats are simply not parsed here. Each line is recognised on its\n"
+    "own, so streams mixing these formats are fine.\n"
     "\n"
     "Usage: adb logcat [options] | " + NAME + " [options] \n"
     "\n"
     "Options:\n"
     "   -i, --ignore        does not output non-matching data\n"
     "                       (by default, those are printed out without colorizing)\n"
+    "   -F, --filter EXPR   only print the lines whose fields match EXPR, e.g.\n"
+    "                       'level>=W && tag in {ActivityManager, WindowManager}'\n"
+    "                       (fields: date, level, tag, pid, tid, message;\n"
+    "                       operators: == != < <= > >= ~ !~ in && || ! and\n"
+    "                       parentheses; quote values holding spaces or operators)\n"
+    "   -A, --after N       with --filter or --spotlight, also print the N lines\n"
+    "                       following each selected line\n"
+    "       --before N      likewise, the N lines preceding each selected line\n"
+    "   -C, --context N     same as --after N --before N; context implies --jobs 1\n"
+    "       --collapse [N]  print a record repeating one of the last N (default: 1,\n"
+    "                       only consecutive repeats) distinct printed records\n"
+    "                       only once, followed later by a 'repeated M times'\n"
+    "                       line; implies --jobs 1\n"
+    "       --rate-limit TAG=N/s\n"
+    "                       print at most N lines per second of TAG, in bursts of\n"
+    "                       up to N, reporting the lines dropped once a second;\n"
+    "                       N/s limits every other tag; can be repeated; implies\n"
+    "                       --jobs 1\n"
+    "   -f, --file PATH     read the log from PATH instead of stdin; when repeated,\n"
+    "                       files or FIFOs are merged by date, each line prefixed\n"
+    "                       with the name of its input; gzip or zstd compressed\n"
+    "                       files and stdin are decompressed on the fly\n"
+    "       --reorder-window MS\n"
+    "                       when merging, how long a line may wait for older ones\n"
+    "                       from the other inputs (default: 500)\n"
+    "       --since DATE    only print the lines dated from DATE on, given as\n"
+    "                       MM-DD[ HH[:MM[:SS[.mmm]]]]; saved logs are searched\n"
+    "                       for it instead of being read from the start\n"
+    "       --until DATE    only print the lines dated up to DATE, and stop reading\n"
+    "                       once past it; a time range implies --jobs 1\n"
+    "       --index         write the index PATH.idx of --file PATH and exit; later\n"
+    "                       runs on PATH with --filter only read the lines the\n"
+    "                       index cannot rule out by date, level or tag\n"
+    "   -B, --binary        the input is the binary output of adb logcat -B\n"
+    "   -j, --jobs N        parse and colorize on N threads, useful to replay large\n"
+    "                       saved logs (default: 1)\n"
+    "   -o, --output MODE   color (default) or json: one JSON object per line with\n"
+    "                       the fields of the record (date, level, tag, pid, tid,\n"
+    "                       message) or the raw line, for scripts\n"
+    "       --line-buffered flush the output after every line\n"
+    "                       (by default, output is flushed when input is idle)\n"
+    "       --max-latency MS\n"
+    "                       while input keeps coming, how long after being read\n"
+    "                       output may be held back to be written in larger\n"
+    "                       chunks (default: 20; 0 flushes whenever all the input\n"
+    "                       read is processed)\n"
+    "       --stats         report throughput, time per stage, parse latency and\n"
+    "                       level and tag counts on stderr at exit and on SIGUSR1\n"
     "   -h, --help          prints this help information\n"
+    "       --tag-colors    print each tag in its own color, the same from one run\n"
+    "                       to the next\n"
     "   -s, --spotlight     highlight pattern in the output, value as REGEXP\n"
-    "                       (i.e, -s '\bWORD\b')\n"
+    "                       (i.e, -s '\bWORD\b'); can be repeated, each pattern\n"
+    "                       gets its own color\n"
+    "       --regex         parse lines with the reference regular expressions\n"
+    "                       instead of the built-in scanner (slower)\n"
+    "       --verify        parse every line with both the scanner and the regular\n"
+    "                       expressions, and search spotlight patterns in lines\n"
+    "                       their literals rule out; report any difference on\n"
+    "                       stderr\n"
+    "       --generic       take the per-line path of mixed-format input even when\n"
+    "                       the input is in a single format (slower; for\n"
+    "                       benchmarks and diagnostics)\n"
     "       --list-ansi     list available ansi escape codes to format the output\n"
     "Environment:\n"
     "Variables can be set to format strings printed to the console. Variables can\n"
@@ -75,6 +168,9 @@ const string HELP =
     "LOGCAT_COLORIZE_ID_{DEBUG, VERBOSE, INFO, WARNING, ERROR, FATAL}\n"
     "LOGCAT_COLORIZE_MSG_{DEBUG, VERBOSE, INFO, WARNING, ERROR, FATAL}\n"
     "LOGCAT_COLORIZE_TID_PID\n"
+    "LOGCAT_COLORIZE_SPOTLIGHT_{1, 2, ...} (color of each --spotlight pattern)\n"
+    "LOGCAT_COLORIZE_TAG_PALETTE (--tag-colors palette, e.g. 33,208,#ff8700;\n"
+    "                             by default it depends on COLORTERM and TERM)\n"
     "\n"
     "The value of each variable can be set to the proper desired ANSI escape code. To\n"
     "print a complete list of the available formats, use the --list-ansi param.\n"
@@ -193,385 +289,4557 @@ ostream& operator<<(ostream& stream, const AnsiSequence& seq)
     return stream;
 }
 
+/*
+ Instrumentation behind --stats. Each thread counts into its own Counters,
+ which only it writes, and report() sums them all up, at exit or whenever
+ SIGUSR1 is received. While disabled, every hook costs a single branch.
+*/
+class Stats
+{
+public:
+    enum Stage { READ, PARSE, SPOTLIGHT, RENDER, WRITE, STAGES };
+
+    static const size_t TOP_TAGS = 10;
+    static const size_t MAX_TAGS = 64*1024;
+
+    static bool enabled;
+
+    // Times a stage over its scope.
+    class Timer
+    {
+    public:
+        Timer(Stage stage) : m_stage(stage), m_start(enabled ? now() : 0) {}
+        ~Timer() {
+            if (enabled)
+                local().time(m_stage, now() - m_start);
+        }
+
+    private:
+        Stage m_stage;
+        uint64_t m_start;
+    };
+
+    // Called at the start of the run, before any other thread is started.
+    static void start() {
+        enabled = true;
+        s_start = now();
+
+        // Only the reporting thread takes SIGUSR1; the mask is inherited.
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGUSR1);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+        thread([signals]() {
+            int signal;
+            while (sigwait(&signals, &signal) == 0)
+                report(cerr);
+        }).detach();
+    }
+
+    static void line(size_t size, bool matched) {
+        Counters& c = local();
+        add(c.lines, 1);
+        add(c.bytes, size + 1);
+        if (!matched)
+            add(c.unmatched, 1);
+    }
+
+    static void record(string_view level, string_view tag) {
+        Counters& c = local();
+        add(c.levels[level.size() == 1 ? static_cast<unsigned char>(level[0]) : 0], 1);
+        lock_guard<mutex> lock(c.tagsMutex);
+        c.tag.assign(tag.data(), tag.size());
+        auto it = c.tags.find(c.tag);
+        if (it != c.tags.end())
+            it->second++;
+        else if (c.tags.size() < MAX_TAGS)
+            c.tags.emplace(c.tag, 1);
+        else
+            c.otherTags++;
+    }
+
+    static void report(ostream& stream) {
+        uint64_t lines = 0, bytes = 0, unmatched = 0, otherTags = 0;
+        uint64_t time[STAGES] = {};
+        uint64_t calls[STAGES] = {};
+        uint64_t histogram[64] = {};
+        uint64_t levels[256] = {};
+        unordered_map<string, uint64_t> tags;
+        {
+            lock_guard<mutex> lock(s_mutex);
+            for (const unique_ptr<Counters>& c : s_counters) {
+                lines += c->lines;
+                bytes += c->bytes;
+                unmatched += c->unmatched;
+                for (int i = 0; i < STAGES; i++) {
+                    time[i] += c->stages[i];
+                    calls[i] += c->calls[i];
+                }
+                for (int i = 0; i < 64; i++)
+                    histogram[i] += c->histogram[i];
+                for (int i = 0; i < 256; i++)
+                    levels[i] += c->levels[i];
+                lock_guard<mutex> tagsLock(c->tagsMutex);
+                for (const auto& tag : c->tags)
+                    tags[tag.first] += tag.second;
+                otherTags += c->otherTags;
+            }
+        }
+
+        double elapsed = (now() - s_start)/1e9;
+        auto seconds = [](uint64_t ns) { return format("%.3f s", ns/1e9); };
+        auto syscalls = [&](Stage stage) {
+            return format(" in %llu calls", static_cast<unsigned long long>(calls[stage])) +
+                   format(" (%.3f per line)", lines ? static_cast<double>(calls[stage])/lines : 0.0);
+        };
+        stream << "--- " << NAME << " statistics ---\n"
+               << "elapsed:    " << format("%.3f s", elapsed) << "\n"
+               << "lines:      " << lines << format(" (%.0f/s), ", lines/elapsed)
+               << format("%.1f%% unmatched", lines ? 100.0*unmatched/lines : 0.0) << "\n"
+               << "bytes:      " << bytes << format(" (%.1f MB/s)", bytes/elapsed/1e6) << "\n"
+               << "read:       " << seconds(time[READ]) << syscalls(READ) << "\n"
+               << "parse:      " << seconds(time[PARSE]) << "\n"
+               << "spotlight:  " << seconds(time[SPOTLIGHT]) << "\n"
+               << "render:     " << seconds(time[RENDER] - min(time[RENDER], time[SPOTLIGHT])) << "\n"
+               << "write:      " << seconds(time[WRITE]) << syscalls(WRITE) << "\n";
+
+        // Percentiles are the upper bounds of the power of two buckets.
+        uint64_t parsed = 0;
+        for (uint64_t count : histogram)
+            parsed += count;
+        stream << "parse latency:";
+        for (double percentile : { 0.5, 0.9, 0.99, 1.0 }) {
+            uint64_t seen = 0;
+            int i = 0;
+            while (i < 63 && (seen += histogram[i]) < percentile*parsed)
+                i++;
+            stream << format(percentile < 1 ? " p%g" : " max", percentile*100)
+                   << " <" << (1ULL << i) << " ns";
+        }
+        stream << "\n";
+        for (int i = 0; i < 64; i++)
+            if (histogram[i])
+                stream << format("  <%10llu ns %12llu\n", 1ULL << i, static_cast<unsigned long long>(histogram[i]));
+
+        stream << "levels:    ";
+        for (char level : string("VDIWEF"))
+            stream << " " << level << " " << levels[static_cast<unsigned char>(level)];
+        stream << "\n";
+
+        vector<pair<string, uint64_t>> top(tags.begin(), tags.end());
+        size_t count = min(TOP_TAGS, top.size());
+        partial_sort(top.begin(), top.begin() + count, top.end(),
+                     [](const pair<string, uint64_t>& a, const pair<string, uint64_t>& b) {
+                         return a.second > b.second;
+                     });
+        stream << "top tags:\n";
+        for (size_t i = 0; i < count; i++)
+            stream << format("  %12llu ", static_cast<unsigned long long>(top[i].second)) << top[i].first << "\n";
+        if (otherTags)
+            stream << "  (" << otherTags << " more records with tags beyond the first " << MAX_TAGS << ")\n";
+        stream << flush;
+    }
+
+private:
+    // Written by a single thread, read by report().
+    struct Counters {
+        atomic<uint64_t> lines{0}, bytes{0}, unmatched{0};
+        atomic<uint64_t> stages[STAGES] = {};
+        atomic<uint64_t> calls[STAGES] = {};
+        atomic<uint64_t> histogram[64] = {};
+        atomic<uint64_t> levels[256] = {};
+        mutex tagsMutex;
+        unordered_map<string, uint64_t> tags;
+        uint64_t otherTags = 0;
+        string tag;
+
+        void time(Stage stage, uint64_t ns) {
+            add(stages[stage], ns);
+            add(calls[stage], 1);
+            if (stage == PARSE)
+                add(histogram[ns ? 64 - __builtin_clzll(ns) : 0], 1);
+        }
+    };
+
+    static void add(atomic<uint64_t>& counter, uint64_t value) {
+        counter.store(counter.load(memory_order_relaxed) + value, memory_order_relaxed);
+    }
+
+    static uint64_t now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+    }
+
+    static Counters& local() {
+        thread_local Counters* counters = nullptr;
+        if (!counters) {
+            lock_guard<mutex> lock(s_mutex);
+            s_counters.emplace_back(new Counters);
+            counters = s_counters.back().get();
+        }
+        return *counters;
+    }
+
+    template <class... Args>
+    static string format(const char* layout, Args... args) {
+        char buffer[64];
+        snprintf(buffer, sizeof(buffer), layout, args...);
+        return buffer;
+    }
+
+    static uint64_t s_start;
+    static mutex s_mutex;
+    static vector<unique_ptr<Counters>> s_counters;
+};
+
+bool Stats::enabled = false;
+uint64_t Stats::s_start = 0;
+mutex Stats::s_mutex;
+vector<unique_ptr<Stats::Counters>> Stats::s_counters;
+
+/*
+ Buffered writer for stdout. Lines are appended to a reusable buffer that is
+ written out when full, when the caller runs out of input or, if line
+ buffering is requested, after every line.
+ Without a file descriptor, the buffer grows instead and holds the whole
+ output until it is read back with data() and cleared.
+*/
+class Output
+{
+public:
+    static const size_t CAPACITY = 64*1024;
+
+    Output(int fd = -1) : m_fd(fd), m_capacity(CAPACITY), m_size(0), m_lineBuffered(false) {
+        m_buffer.reset(new char[m_capacity]);
+    }
+    ~Output() {
+        try {
+            flush();
+        }
+        catch (...) {}
+    }
+
+    void setLineBuffered(bool lineBuffered) { m_lineBuffered = lineBuffered; }
+
+    void append(const char* data, size_t size) {
+        if (size > m_capacity - m_size && m_fd < 0)
+            reserve(m_size + size);
+        if (size <= m_capacity - m_size) {
+            memcpy(m_buffer.get() + m_size, data, size);
+            m_size += size;
+            return;
+        }
+
+        // Does not fit: send what is buffered and the new data in one go.
+        struct iovec iov[2];
+        iov[0].iov_base = m_buffer.get();
+        iov[0].iov_len = m_size;
+        iov[1].iov_base = const_cast<char*>(data);
+        iov[1].iov_len = size;
+        writeAll(iov, 2);
+        m_size = 0;
+    }
+    void append(string_view data) { append(data.data(), data.size()); }
+    void append(char c) {
+        if (m_size == m_capacity) {
+            if (m_fd < 0)
+                reserve(m_size + 1);
+            else
+                flush();
+        }
+        m_buffer[m_size++] = c;
+    }
+
+    void endLine() {
+        append('\n');
+        if (m_lineBuffered)
+            flush();
+    }
+
+    string_view data() const { return string_view(m_buffer.get(), m_size); }
+    void clear() { m_size = 0; }
+
+    void flush() {
+        if (!m_size || m_fd < 0)
+            return;
+        struct iovec iov;
+        iov.iov_base = m_buffer.get();
+        iov.iov_len = m_size;
+        writeAll(&iov, 1);
+        m_size = 0;
+    }
+
+private:
+    void reserve(size_t size) {
+        size_t capacity = m_capacity;
+        while (capacity < size)
+            capacity *= 2;
+        unique_ptr<char[]> buffer(new char[capacity]);
+        memcpy(buffer.get(), m_buffer.get(), m_size);
+        m_buffer.swap(buffer);
+        m_capacity = capacity;
+    }
+
+    void writeAll(struct iovec* iov, int count) {
+        Stats::Timer timer(Stats::WRITE);
+        while (count) {
+            ssize_t written = writev(m_fd, iov, count);
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                throw runtime_error(string("cannot write output: ") + strerror(errno));
+            }
+            for (; count && static_cast<size_t>(written) >= iov->iov_len; iov++, count--)
+                written -= iov->iov_len;
+            if (count) {
+                iov->iov_base = static_cast<char*>(iov->iov_base) + written;
+                iov->iov_len -= written;
+            }
+        }
+    }
+
+    int m_fd;
+    unique_ptr<char[]> m_buffer;
+    size_t m_capacity;
+    size_t m_size;
+    bool m_lineBuffered;
+};
+
+Output& operator<<(Output& out, string_view data)
+{
+    out.append(data);
+    return out;
+}
+
+Output& operator<<(Output& out, const AnsiSequence& seq)
+{
+    out.append(seq.str());
+    return out;
+}
+
+/*
+ Decompresses gzip or zstd input on its own thread, which hands blocks of
+ decompressed data over through a bounded queue. The thread reads its own
+ copy of the descriptor and shares its state with the reader, so that it
+ can be left behind blocked on a pipe when the reader stops early.
+*/
+class Decompressor
+{
+public:
+    enum Codec { NONE, GZIP, ZSTD };
+
+    static const size_t BLOCK_SIZE = 128*1024;
+    static const size_t QUEUE_BLOCKS = 8;
+    static const size_t MAGIC_SIZE = 4;
+
+    // The codec whose magic number starts head, which holds at least the
+    // first MAGIC_SIZE bytes of the input when it has that many.
+    static Codec detect(string_view head) {
+        if (head.size() >= 2 && head[0] == '\x1f' && head[1] == '\x8b')
+            return GZIP;
+        if (head.size() >= 4 && head.substr(0, 4) == string_view("\x28\xb5\x2f\xfd", 4))
+            return ZSTD;
+        return NONE;
+    }
+
+    // Reads fd from its current offset, after the bytes in ahead which were
+    // already read from it.
+    Decompressor(int fd, Codec codec, const string& ahead, const string& name) :
+        m_state(make_shared<State>()) {
+#ifndef LOGCAT_COLORIZE_ZSTD
+        if (codec == ZSTD)
+            throw runtime_error(name + " is compressed with zstd, which this build does not support (see Makefile)");
+#endif
+        int copy = dup(fd);
+        if (copy < 0)
+            throw runtime_error("cannot read " + name + ": " + strerror(errno));
+        thread(&Decompressor::run, m_state, copy, codec, ahead, name).detach();
+    }
+
+    ~Decompressor() {
+        {
+            lock_guard<mutex> lock(m_state->lock);
+            m_state->closed = true;
+        }
+        m_state->cond.notify_all();
+    }
+
+    // Whether read() would return without waiting.
+    bool ready() {
+        if (m_offset < m_current.size())
+            return true;
+        lock_guard<mutex> lock(m_state->lock);
+        return !m_state->blocks.empty() || m_state->done;
+    }
+
+    // Blocks until decompressed data is available. Returns 0 at the end.
+    size_t read(char* buffer, size_t size) {
+        State& state = *m_state;
+        if (m_offset == m_current.size()) {
+            unique_lock<mutex> lock(state.lock);
+            if (!m_current.empty())
+                state.free.push_back(move(m_current));
+            state.cond.wait(lock, [&] { return !state.blocks.empty() || state.done; });
+            if (state.blocks.empty()) {
+                if (state.error)
+                    rethrow_exception(state.error);
+                m_current.clear();
+                m_offset = 0;
+                return 0;
+            }
+            m_current = move(state.blocks.front());
+            state.blocks.pop_front();
+            m_offset = 0;
+            state.cond.notify_all();
+        }
+        size = min(size, m_current.size() - m_offset);
+        memcpy(buffer, m_current.data() + m_offset, size);
+        m_offset += size;
+        return size;
+    }
+
+private:
+    Decompressor(const Decompressor&) = delete;
+    Decompressor& operator=(const Decompressor&) = delete;
+
+    struct State {
+        State() : done(false), closed(false) {}
+        deque<string> blocks;
+        vector<string> free;
+        bool done;
+        bool closed;
+        exception_ptr error;
+        mutex lock;
+        condition_variable cond;
+    };
+
+    // Reads compressed data, first what was read ahead. Returns 0 at the end.
+    class Source {
+    public:
+        Source(int fd, const string& ahead, const string& name) :
+            m_fd(fd), m_ahead(ahead), m_name(name), m_buffer(new char[BLOCK_SIZE]) {}
+        ~Source() { ::close(m_fd); }
+
+        string_view read() {
+            if (!m_ahead.empty()) {
+                m_data.swap(m_ahead);
+                m_ahead.clear();
+                return m_data;
+            }
+            while (true) {
+                ssize_t count = ::read(m_fd, m_buffer.get(), BLOCK_SIZE);
+                if (count >= 0)
+                    return string_view(m_buffer.get(), count);
+                if (errno != EINTR)
+                    throw runtime_error("cannot read " + m_name + ": " + strerror(errno));
+            }
+        }
+
+    private:
+        int m_fd;
+        string m_ahead;
+        string m_data;
+        const string m_name;
+        unique_ptr<char[]> m_buffer;
+    };
+
+    // Hands a full block over, waiting for room in the queue, and returns
+    // an empty one. Returns false once the reader is gone.
+    static bool push(State& state, string& block) {
+        unique_lock<mutex> lock(state.lock);
+        state.cond.wait(lock, [&] { return state.blocks.size() < QUEUE_BLOCKS || state.closed; });
+        if (state.closed)
+            return false;
+        state.blocks.push_back(move(block));
+        if (!state.free.empty()) {
+            block = move(state.free.back());
+            state.free.pop_back();
+        }
+        block.resize(BLOCK_SIZE);
+        state.cond.notify_all();
+        return true;
+    }
+
+    static void run(shared_ptr<State> state, int fd, Codec codec, string ahead, string name) {
+        try {
+            Source source(fd, ahead, name);
+            if (codec == GZIP)
+                gunzip(*state, source, name);
+#ifdef LOGCAT_COLORIZE_ZSTD
+            else
+                unzstd(*state, source, name);
+#endif
+        }
+        catch (...) {
+            lock_guard<mutex> lock(state->lock);
+            state->error = current_exception();
+        }
+        {
+            lock_guard<mutex> lock(state->lock);
+            state->done = true;
+        }
+        state->cond.notify_all();
+    }
+
+    // Concatenated members are decompressed one after the other, like gzip
+    // -d does.
+    static void gunzip(State& state, Source& source, const string& name) {
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        // 16 selects the gzip wrapper.
+        if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK)
+            throw runtime_error("cannot decompress " + name);
+        unique_ptr<z_stream, int(*)(z_stream*)> guard(&stream, inflateEnd);
+
+        string block(BLOCK_SIZE, '\0');
+        size_t size = 0;
+        bool member = false;
+        string_view input;
+        while (true) {
+            if (input.empty()) {
+                input = source.read();
+                if (input.empty())
+                    break;
+            }
+            stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+            stream.avail_in = static_cast<uInt>(input.size());
+            stream.next_out = reinterpret_cast<Bytef*>(&block[size]);
+            stream.avail_out = static_cast<uInt>(BLOCK_SIZE - size);
+            int result = inflate(&stream, Z_NO_FLUSH);
+            member = true;
+            input.remove_prefix(input.size() - stream.avail_in);
+            size = BLOCK_SIZE - stream.avail_out;
+            if (result == Z_STREAM_END) {
+                inflateReset(&stream);
+                member = false;
+            }
+            else if (result != Z_OK && result != Z_BUF_ERROR)
+                throw runtime_error("cannot decompress " + name + ": " +
+                                    (stream.msg ? stream.msg : "corrupt data"));
+            if (size == BLOCK_SIZE) {
+                if (!push(state, block))
+                    return;
+                size = 0;
+            }
+        }
+        if (member)
+            throw runtime_error("cannot decompress " + name + ": unexpected end of data");
+        block.resize(size);
+        if (size)
+            push(state, block);
+    }
+
+#ifdef LOGCAT_COLORIZE_ZSTD
+    static void unzstd(State& state, Source& source, const string& name) {
+        unique_ptr<ZSTD_DStream, size_t(*)(ZSTD_DStream*)> stream(ZSTD_createDStream(), ZSTD_freeDStream);
+        if (!stream)
+            throw runtime_error("cannot decompress " + name);
+
+        string block(BLOCK_SIZE, '\0');
+        size_t size = 0;
+        size_t hint = 0;
+        string_view input;
+        while (true) {
+            if (input.empty()) {
+                input = source.read();
+                if (input.empty())
+                    break;
+            }
+            ZSTD_inBuffer in = { input.data(), input.size(), 0 };
+            ZSTD_outBuffer out = { &block[0], BLOCK_SIZE, size };
+            hint = ZSTD_decompressStream(stream.get(), &out, &in);
+            if (ZSTD_isError(hint))
+                throw runtime_error("cannot decompress " + name + ": " + ZSTD_getErrorName(hint));
+            input.remove_prefix(in.pos);
+            size = out.pos;
+            if (size == BLOCK_SIZE) {
+                if (!push(state, block))
+                    return;
+                size = 0;
+            }
+        }
+        if (hint)
+            throw runtime_error("cannot decompress " + name + ": unexpected end of data");
+        block.resize(size);
+        if (size)
+            push(state, block);
+    }
+#endif
+
+    shared_ptr<State> m_state;
+    string m_current;
+    size_t m_offset = 0;
+};
+
+/*
+ Raw bytes of an input descriptor. Once detect() has found it compressed,
+ they come decompressed from a Decompressor.
+*/
+class Input
+{
+public:
+    Input(int fd) : m_fd(fd) {}
+
+    int fd() const { return m_fd; }
+    bool compressed() const { return m_decompressor != nullptr; }
+
+    // Looks for the magic number of a compressed format at the start of the
+    // input. Regular files are peeked at; other inputs have their first
+    // bytes read ahead, which read() returns first. Returns compressed().
+    bool detect(const string& name) {
+        char head[Decompressor::MAGIC_SIZE];
+        size_t size = 0;
+        struct stat info;
+        off_t offset = 0;
+        if (fstat(m_fd, &info) == 0 && S_ISREG(info.st_mode) &&
+                (offset = lseek(m_fd, 0, SEEK_CUR)) >= 0) {
+            ssize_t count = pread(m_fd, head, sizeof(head), offset);
+            size = count > 0 ? count : 0;
+        }
+        else {
+            while (size < sizeof(head)) {
+                ssize_t count = ::read(m_fd, head + size, sizeof(head) - size);
+                if (count < 0 && errno == EINTR)
+                    continue;
+                if (count < 0)
+                    throw runtime_error("cannot read " + name + ": " + strerror(errno));
+                if (count == 0)
+                    break;
+                size += count;
+            }
+            m_ahead.assign(head, size);
+        }
+
+        Decompressor::Codec codec = Decompressor::detect(string_view(head, size));
+        if (codec != Decompressor::NONE) {
+            m_decompressor.reset(new Decompressor(m_fd, codec, m_ahead, name));
+            m_ahead.clear();
+        }
+        return compressed();
+    }
+
+    // Whether read() would return without waiting.
+    bool ready() {
+        if (!m_ahead.empty())
+            return true;
+        if (m_decompressor)
+            return m_decompressor->ready();
+        struct pollfd fd = { m_fd, POLLIN, 0 };
+        return poll(&fd, 1, 0) > 0 && (fd.revents & POLLIN);
+    }
+
+    // Like read(2).
+    ssize_t read(char* buffer, size_t size) {
+        if (!m_ahead.empty()) {
+            size = min(size, m_ahead.size());
+            memcpy(buffer, m_ahead.data(), size);
+            m_ahead.erase(0, size);
+            return size;
+        }
+        if (m_decompressor)
+            return m_decompressor->read(buffer, size);
+        return ::read(m_fd, buffer, size);
+    }
+
+private:
+    Input(const Input&) = delete;
+    Input& operator=(const Input&) = delete;
+
+    int m_fd;
+    string m_ahead;
+    unique_ptr<Decompressor> m_decompressor;
+};
+
+/*
+ Splits an input into lines without copying them. The input is either an
+ Input, read in large blocks, or data already in memory. Lines are
+ views into the buffer, without the newline nor a carriage return before
+ it, and stay valid until the next fill().
+*/
+class LineReader
+{
+public:
+    static const size_t BLOCK_SIZE = 128*1024;
+    static const size_t ENTRY_SLACK = 16*1024;
+
+    LineReader(Input& input, size_t blockSize = BLOCK_SIZE) :
+        m_input(&input), m_capacity(blockSize), m_begin(0), m_end(0), m_eof(false) {
+        m_buffer.reset(new char[m_capacity]);
+        m_data = m_buffer.get();
+    }
+    LineReader(string_view data) :
+        m_input(nullptr), m_data(data.data()), m_capacity(data.size()), m_begin(0), m_end(data.size()), m_eof(true) {}
+
+    // Next complete line already buffered. At the end of the input, this
+    // includes a last line without a newline.
+    bool next(string_view& line) {
+        if (m_begin == m_end)
+            return false;
+        const char* p = m_data + m_begin;
+        const char* eol = static_cast<const char*>(memchr(p, '\n', m_end - m_begin));
+        if (!eol) {
+            if (!m_eof)
+                return false;
+            eol = m_data + m_end;
+        }
+        size_t size = eol - p;
+        m_begin = min(m_begin + size + 1, m_end);
+        if (size && p[size - 1] == '\r' && eol != m_data + m_end)
+            size--;
+        line = string_view(p, size);
+        return true;
+    }
+
+    // Complete lines already buffered, about size bytes of them when more
+    // are available. They still end with their newlines. A block rather ends
+    // with a blank line, if one is buffered within ENTRY_SLACK bytes, so as
+    // not to split the multi-line entries of -v long.
+    bool nextBlock(string_view& block, size_t size) {
+        if (m_begin == m_end)
+            return false;
+        const char* p = m_data + m_begin;
+        size_t available = m_end - m_begin;
+        size = min(size, available);
+        const char* eol = static_cast<const char*>(memchr(p + size - 1, '\n', available - size + 1));
+        if (!eol && m_eof)
+            size = available;
+        else {
+            if (!eol)
+                eol = lastNewline(p, p + available);
+            if (!eol)
+                return false;
+            size = entryEnd(p, eol, p + available) + 1 - p;
+        }
+        m_begin += size;
+        block = string_view(p, size);
+        return true;
+    }
+
+    // Lines buffered but not consumed yet, the last one maybe partial.
+    string_view buffered() const {
+        return string_view(m_data + m_begin, m_end - m_begin);
+    }
+
+    // Reads more of the input, blocking if needed, unless the descriptor is
+    // non-blocking. Returns false at the end of the input once everything
+    // buffered has been consumed.
+    bool fill() {
+        if (m_eof)
+            return m_begin != m_end;
+
+        // Keep the partial line at the start of the buffer, growing it for
+        // lines longer than a block.
+        size_t pending = m_end - m_begin;
+        if (pending == m_capacity) {
+            unique_ptr<char[]> buffer(new char[m_capacity*2]);
+            memcpy(buffer.get(), m_data + m_begin, pending);
+            m_buffer.swap(buffer);
+            m_data = m_buffer.get();
+            m_capacity *= 2;
+        }
+        else if (m_begin)
+            memmove(m_buffer.get(), m_data + m_begin, pending);
+        m_begin = 0;
+        m_end = pending;
+
+        Stats::Timer timer(Stats::READ);
+        while (true) {
+            ssize_t count = m_input->read(m_buffer.get() + m_end, m_capacity - m_end);
+            if (count < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return true;
+                throw runtime_error(string("cannot read input: ") + strerror(errno));
+            }
+            if (count == 0) {
+                m_eof = true;
+                return m_begin != m_end;
+            }
+            m_end += count;
+            return true;
+        }
+    }
+
+private:
+    LineReader(const LineReader&) = delete;
+    LineReader& operator=(const LineReader&) = delete;
+
+    // The newline ending the blank line nearest to eol, after it then before
+    // it, or eol itself. Blank lines may end with "\r\n".
+    static const char* entryEnd(const char* begin, const char* eol, const char* end) {
+        const char* limit = eol + min<size_t>(ENTRY_SLACK, end - eol);
+        for (const char* q = eol + 1; q < limit; ++q) {
+            q = static_cast<const char*>(memchr(q, '\n', limit - q));
+            if (!q)
+                break;
+            if (endsBlankLine(begin, q))
+                return q;
+        }
+        for (const char* q = eol; q > begin && static_cast<size_t>(eol - q) < ENTRY_SLACK;
+             q = lastNewline(begin, q)) {
+            if (!q)
+                break;
+            if (endsBlankLine(begin, q))
+                return q;
+        }
+        return eol;
+    }
+
+    // The last newline between begin and end, if any. This is memrchr(),
+    // which is missing from some C libraries.
+    static const char* lastNewline(const char* begin, const char* end) {
+        while (end > begin)
+            if (*--end == '\n')
+                return end;
+        return nullptr;
+    }
+
+    // Whether the newline at eol ends an empty line.
+    static bool endsBlankLine(const char* begin, const char* eol) {
+        if (eol > begin && eol[-1] == '\r')
+            --eol;
+        return eol > begin && eol[-1] == '\n';
+    }
+
+    Input* m_input;
+    unique_ptr<char[]> m_buffer;
+    const char* m_data;
+    size_t m_capacity;
+    size_t m_begin;
+    size_t m_end;
+    bool m_eof;
+};
+
+/*
+ A parsed line. Fields are views into the line buffer, which must outlive
+ the record; they are valid until the next parse().
+*/
 struct Logcat {
-    string date;
-    string level;
-    string tag;
-    string process;
-    string message; 
-    string thread;
+    string_view date;
+    string_view level;
+    string_view tag;
+    string_view process;
+    string_view message; 
+    string_view thread;
+
+    bool operator==(const Logcat& other) const {
+        return date == other.date && level == other.level && tag == other.tag &&
+               process == other.process && message == other.message && thread == other.thread;
+    }
 };
 
-class Format {
+/*
+ Helpers for the hand-written scanners. Each scanner mirrors the regular
+ expression of its format, including the choices made by backtracking, so
+ that both produce exactly the same fields.
+*/
+namespace scan {
 
-protected:
-    Logcat l;
-    boost::regex pattern;
-    boost::regex spotlight_pattern;
-    boost::regex escapeSequencePattern;
-    string spotlight_color;
-    boost::smatch match(const string& raw) {
-        string::const_iterator start;
-        start = raw.begin();
-        boost::smatch results;
-        boost::match_flag_type flags = boost::match_default;
-        boost::regex_search(start, raw.end(), results, this->pattern, flags);
-        return results;
+inline bool isLevel(char c) {
+    return c == 'V' || c == 'D' || c == 'I' || c == 'W' || c == 'E' || c == 'F';
+}
+
+inline bool isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// [ 0-9]
+inline bool isPidChar(char c) {
+    return c == ' ' || isDigit(c);
+}
+
+// [[:space:]] and \s, once line separators have been excluded.
+inline bool isSpace(char c) {
+    return c == ' ' || c == '\t';
+}
+
+/*
+ The regular expressions let '^' and '$' match around line separators and
+ '\s' match them too. Lines holding one of those are rare, so they are left
+ to the regex path instead of complicating the scanners.
+*/
+inline bool hasSeparator(const char* p, const char* end) {
+    for (; p != end; ++p)
+        if (static_cast<unsigned char>(*p - '\n') <= '\r' - '\n')
+            return true;
+    return false;
+}
+
+inline string_view slice(const char* begin, const char* end) {
+    return string_view(begin, end - begin);
+}
+
+// First occurrence of ": " at or after p.
+inline const char* findColonSpace(const char* p, const char* end) {
+    while (p < end) {
+        p = static_cast<const char*>(memchr(p, ':', end - p));
+        if (!p || p + 1 == end)
+            return nullptr;
+        if (p[1] == ' ')
+            return p;
+        ++p;
+    }
+    return nullptr;
+}
+
+// [0-9]{2}-[0-9]{2} [0-9]{2}:[0-9]{2}:[0-9]{2}.[0-9]{3}
+const size_t DATE_LENGTH = 18;
+inline bool isDate(const char* p, const char* end) {
+    if (end - p < static_cast<ptrdiff_t>(DATE_LENGTH))
+        return false;
+    static const char layout[] = "dd-dd dd:dd:dd.ddd";
+    for (size_t i = 0; i < DATE_LENGTH; i++) {
+        if (layout[i] == 'd') {
+            if (!isDigit(p[i]))
+                return false;
+        }
+        else if (layout[i] != '.' && p[i] != layout[i])
+            return false;
+    }
+    return true;
+}
+
+}
+
+/*
+ Writers of JSON values straight into an Output, for --output json. Strings
+ are escaped as they are copied. Bytes which are not valid UTF-8 become
+ U+FFFD, so that the output always parses.
+*/
+namespace json {
+
+// Length of the UTF-8 sequence starting at p. When it is not valid, this
+// is the length of its longest valid start, to be replaced as a whole.
+inline size_t utf8Length(const unsigned char* p, const unsigned char* end, bool& valid) {
+    unsigned char c = p[0];
+    size_t length;
+    unsigned char low = 0x80, high = 0xbf;
+    valid = false;
+    if (c >= 0xc2 && c <= 0xdf)
+        length = 2;
+    else if (c >= 0xe0 && c <= 0xef) {
+        length = 3;
+        if (c == 0xe0)
+            low = 0xa0;
+        else if (c == 0xed)
+            high = 0x9f;
+    }
+    else if (c >= 0xf0 && c <= 0xf4) {
+        length = 4;
+        if (c == 0xf0)
+            low = 0x90;
+        else if (c == 0xf4)
+            high = 0x8f;
+    }
+    else
+        return 1;
+    size_t i = 1;
+    for (; i < length && p + i != end && p[i] >= low && p[i] <= high; i++) {
+        low = 0x80;
+        high = 0xbf;
+    }
+    valid = i == length;
+    return i;
+}
+
+// Writes value as a quoted string.
+inline void quote(Output& out, string_view value) {
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(value.data());
+    const unsigned char* end = p + value.size();
+    out.append('"');
+    while (p != end) {
+        // Copy the run of bytes which need no escaping at once, looking at
+        // 8 of them at a time for a control character, a quote, a backslash
+        // or a non-ASCII byte.
+        const unsigned char* run = p;
+        const uint64_t ones = 0x0101010101010101ULL, highs = 0x8080808080808080ULL;
+        for (uint64_t word; end - p >= 8; p += 8) {
+            memcpy(&word, p, 8);
+            uint64_t quotes = word ^ (ones*'"'), backslashes = word ^ (ones*'\\');
+            uint64_t special = ((word - ones*0x20) & ~word) | ((quotes - ones) & ~quotes) |
+                               ((backslashes - ones) & ~backslashes) | word;
+            if (special & highs)
+                break;
+        }
+        while (p != end && *p >= 0x20 && *p < 0x80 && *p != '"' && *p != '\\')
+            ++p;
+        out.append(reinterpret_cast<const char*>(run), p - run);
+        if (p == end)
+            break;
+
+        unsigned char c = *p;
+        if (c >= 0x80) {
+            bool valid;
+            size_t length = utf8Length(p, end, valid);
+            if (valid)
+                out.append(reinterpret_cast<const char*>(p), length);
+            else
+                out.append("\\ufffd", 6);
+            p += length;
+            continue;
+        }
+        out.append('\\');
+        switch (c) {
+        case '"': out.append('"'); break;
+        case '\\': out.append('\\'); break;
+        case '\n': out.append('n'); break;
+        case '\r': out.append('r'); break;
+        case '\t': out.append('t'); break;
+        case '\b': out.append('b'); break;
+        case '\f': out.append('f'); break;
+        default:
+            out.append("u00", 3);
+            out.append(hex[c >> 4]);
+            out.append(hex[c & 0xf]);
+        }
+        ++p;
+    }
+    out.append('"');
+}
+
+// Writes a process or thread id as a number, from decimal, possibly space
+// padded, or from 0x prefixed hex as the formats give them, or as a string
+// otherwise.
+inline void id(Output& out, string_view value) {
+    string_view padded = value;
+    value.remove_prefix(min(value.find_first_not_of(' '), value.size()));
+    if (value.empty()) {
+        quote(out, padded);
+        return;
+    }
+    bool decimal = !value.empty() && value.size() <= 18 && (value[0] != '0' || value.size() == 1);
+    for (char c : value)
+        decimal = decimal && scan::isDigit(c);
+    if (decimal) {
+        out.append(value);
+        return;
+    }
+    if (value.size() > 2 && value.size() <= 17 && value[0] == '0' && value[1] == 'x') {
+        uint64_t number = 0;
+        for (char c : value.substr(2)) {
+            int digit = scan::isDigit(c) ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 :
+                        (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+            if (digit < 0) {
+                quote(out, value);
+                return;
+            }
+            number = number*16 + digit;
+        }
+        char digits[24];
+        out.append(digits, snprintf(digits, sizeof(digits), "%llu", static_cast<unsigned long long>(number)));
+        return;
+    }
+    quote(out, value);
+}
+
+}
+
+boost::optional<AnsiSequence> parseEscapeSequenceVariable(const string& envVar) {
+    static const boost::regex escapeSequencePattern("\\^\\[(\\d+);(\\d+);(\\d+)m$");
+    char* envValue = getenv(envVar.c_str());
+    if (!envValue)
+        return boost::none;
+    
+    const string escapeSequenceString(envValue);
+    string::const_iterator start;
+    start = escapeSequenceString.begin();
+    boost::smatch results;
+    boost::match_flag_type flags = boost::match_default;
+    boost::regex_search(start, escapeSequenceString.end(), results, escapeSequencePattern, flags);
+    if (results.size() >= 4) {
+        string attr = results[1];
+        string bg = results[2];
+        string fg = results[3];
+        return AnsiSequence(attr, bg, fg);
+    }
+    
+    return boost::none;
+}
+
+/*
+ Aho-Corasick automaton telling whether a text contains any of a set of
+ literals, in a single pass.
+*/
+class LiteralMatcher
+{
+public:
+    LiteralMatcher() : m_next(1), m_accept(1, false) {
+        m_next[0].fill(0);
+    }
+
+    void add(const string& literal) {
+        int state = 0;
+        for (unsigned char c : literal) {
+            if (!m_next[state][c]) {
+                m_next[state][c] = static_cast<int>(m_next.size());
+                m_next.emplace_back();
+                m_next.back().fill(0);
+                m_accept.push_back(false);
+            }
+            state = m_next[state][c];
+        }
+        m_accept[state] = true;
+    }
+
+    // Turns the trie into a complete transition table. Call once, after all
+    // the literals are added.
+    void build() {
+        vector<int> fail(m_next.size(), 0);
+        vector<int> queue;
+        for (int c = 0; c < 256; c++)
+            if (m_next[0][c])
+                queue.push_back(m_next[0][c]);
+        for (size_t i = 0; i < queue.size(); i++) {
+            int state = queue[i];
+            m_accept[state] = m_accept[state] || m_accept[fail[state]];
+            for (int c = 0; c < 256; c++) {
+                int child = m_next[state][c];
+                if (child) {
+                    fail[child] = m_next[fail[state]][c];
+                    queue.push_back(child);
+                }
+                else
+                    m_next[state][c] = m_next[fail[state]][c];
+            }
+        }
+    }
+
+    bool search(string_view text) const {
+        int state = 0;
+        for (unsigned char c : text) {
+            state = m_next[state][c];
+            if (m_accept[state])
+                return true;
+        }
+        return false;
+    }
+
+private:
+    vector<array<int, 256>> m_next;
+    vector<bool> m_accept;
+};
+
+/*
+ Set of --spotlight patterns, each with its own color. The patterns are
+ alternated into one regular expression, so each field is searched once, and
+ a literal each match must contain is extracted from every pattern so that
+ fields holding none of them skip the regular expression.
+*/
+class Spotlight
+{
+public:
+    Spotlight(const vector<string>& patterns) : m_alwaysSearch(false) {
+        static const AnsiSequence palette[] = {
+            AnsiSequence(Attribute::reset, Color::bred, Color::fwhite),
+            AnsiSequence(Attribute::reset, Color::byellow, Color::fblack),
+            AnsiSequence(Attribute::reset, Color::bgreen, Color::fblack),
+            AnsiSequence(Attribute::reset, Color::bblue, Color::fwhite),
+            AnsiSequence(Attribute::reset, Color::bpurple, Color::fwhite),
+            AnsiSequence(Attribute::reset, Color::bcyan, Color::fblack)
+        };
+        const size_t paletteSize = sizeof(palette)/sizeof(palette[0]);
+
+        string combined;
+        size_t group = 1;
+        for (size_t i = 0; i < patterns.size(); i++) {
+            const string& pattern = patterns[i];
+            if (i)
+                combined += "|";
+            combined += "(" + pattern + ")";
+            m_groups.push_back(group);
+            group += boost::regex(pattern).mark_count() + 1;
+
+            boost::optional<AnsiSequence> color =
+                    parseEscapeSequenceVariable("LOGCAT_COLORIZE_SPOTLIGHT_" + to_string(i + 1));
+            m_colors.push_back(color ? color.get() : palette[i % paletteSize]);
+
+            string literal = requiredLiteral(pattern);
+            if (literal.empty())
+                m_alwaysSearch = true;
+            else
+                m_literals.add(literal);
+        }
+        m_pattern = combined;
+        m_literals.build();
+    }
+
+    // Whether text holds a match.
+    bool search(string_view text) const {
+        if (!m_alwaysSearch && !m_literals.search(text) && !missed(text))
+            return false;
+        return boost::regex_search(text.data(), text.data() + text.size(), m_pattern);
+    }
+
+    // Writes text to out, highlighting the matches and going back to resume
+    // after each of them.
+    void highlight(Output& out, string_view text, const AnsiSequence& resume) const {
+        Stats::Timer timer(Stats::SPOTLIGHT);
+        if (!m_alwaysSearch && !m_literals.search(text) && !missed(text)) {
+            out << text;
+            return;
+        }
+
+        const char* last = text.data();
+        boost::cregex_iterator it(text.data(), text.data() + text.size(), m_pattern);
+        for (; it != boost::cregex_iterator(); ++it) {
+            const boost::cmatch& match = *it;
+            size_t i = 0;
+            while (i + 1 < m_groups.size() && !match[m_groups[i]].matched)
+                i++;
+            out << scan::slice(last, match[0].first)
+                << m_colors[i]
+                << scan::slice(match[0].first, match[0].second)
+                << m_reset
+                << resume;
+            last = match[0].second;
+        }
+        out << scan::slice(last, text.data() + text.size());
+    }
+
+    // With --verify, text ruled out by the literals is searched anyway and
+    // the lines the literals wrongly ruled out are reported.
+    static bool verify;
+    static atomic<unsigned long> mismatches;
+
+private:
+    // Whether text ruled out by the literals holds a match all the same,
+    // which only --verify checks.
+    bool missed(string_view text) const {
+        if (!verify || !boost::regex_search(text.data(), text.data() + text.size(), m_pattern))
+            return false;
+        mismatches++;
+        cerr << "Spotlight prefilter mismatch: " << text << endl;
+        return true;
+    }
+
+    /*
+     Longest run of literal characters that any match of the pattern must
+     contain, or an empty string when none can be safely extracted. Only the
+     top level of the pattern is considered, and alternations, flags and
+     escapes standing for other characters than their own make it give up.
+    */
+    static string requiredLiteral(const string& pattern) {
+        string best;
+        string run;
+        int depth = 0;
+        bool lastIsLiteral = false;
+        auto endRun = [&]() {
+            if (run.size() > best.size())
+                best = run;
+            run.clear();
+            lastIsLiteral = false;
+        };
+        auto addLiteral = [&](char c) {
+            if (depth) {
+                endRun();
+                return;
+            }
+            run += c;
+            lastIsLiteral = true;
+        };
+
+        for (size_t i = 0; i < pattern.size(); i++) {
+            char c = pattern[i];
+            switch (c) {
+            case '\\':
+                if (++i == pattern.size())
+                    return string();
+                // Classes and assertions of a single letter; other letters and
+                // digits may read more characters (\x41, \0101, \cA, \Q...).
+                if (strchr("dDwWsSbBAzZnrtfv", pattern[i]))
+                    endRun();
+                else if (isalnum(static_cast<unsigned char>(pattern[i])))
+                    return string();
+                else
+                    addLiteral(pattern[i]);
+                break;
+            case '[':
+                endRun();
+                i++;
+                if (i < pattern.size() && pattern[i] == '^')
+                    i++;
+                if (i < pattern.size() && pattern[i] == ']')
+                    i++;
+                for (; i < pattern.size() && pattern[i] != ']'; i++) {
+                    if (pattern[i] == '\\')
+                        i++;
+                    else if (pattern[i] == '[' && i + 1 < pattern.size() && strchr(":=.", pattern[i + 1])) {
+                        // [:class:], [=equivalent=] or [.collating.]
+                        size_t close = pattern.find(string(1, pattern[i + 1]) + "]", i + 2);
+                        if (close == string::npos)
+                            return string();
+                        i = close + 1;
+                    }
+                }
+                if (i == pattern.size())
+                    return string();
+                break;
+            case '(':
+                if (i + 1 < pattern.size() && pattern[i + 1] == '?')
+                    return string();
+                endRun();
+                depth++;
+                break;
+            case ')':
+                endRun();
+                depth--;
+                break;
+            case '|':
+                if (!depth)
+                    return string();
+                endRun();
+                break;
+            case '*':
+            case '?':
+            case '{':
+                // The previous atom may be absent.
+                if (lastIsLiteral)
+                    run.pop_back();
+                endRun();
+                if (c == '{')
+                    while (i < pattern.size() && pattern[i] != '}')
+                        i++;
+                break;
+            case '+':
+                endRun();
+                break;
+            case '.':
+            case '^':
+            case '$':
+                endRun();
+                break;
+            default:
+                addLiteral(c);
+            }
+        }
+        endRun();
+        return best;
+    }
+
+    boost::regex m_pattern;
+    vector<size_t> m_groups;
+    vector<AnsiSequence> m_colors;
+    AnsiSequenceReset m_reset;
+    LiteralMatcher m_literals;
+    bool m_alwaysSearch;
+};
+
+bool Spotlight::verify = false;
+atomic<unsigned long> Spotlight::mismatches(0);
+
+/*
+ Stable per-tag colors for --tag-colors. A tag gets the palette entry picked
+ by a hash of its text, so it keeps its color from one run to the next.
+ Tags are interned in a direct-mapped table along with the escape sequence
+ opening them, so rendering a known tag costs one probe; a colliding tag
+ evicts the previous one, which caps memory whatever the number of tags.
+*/
+class TagColors
+{
+public:
+    static const size_t CAPACITY = 4096;
+
+    struct Entry {
+        Entry() : hash(0), color(-1) {}
+        uint64_t hash;
+        string tag;
+        string open;
+        size_t color;
+    };
+
+    TagColors() {}
+    TagColors(const vector<AnsiSequence>& palette) : m_palette(palette), m_entries(CAPACITY) {}
+
+    bool enabled() const { return !m_palette.empty(); }
+
+    const Entry& lookup(string_view tag) {
+        uint64_t hash = 14695981039346656037ULL;
+        for (unsigned char c : tag)
+            hash = (hash ^ c)*1099511628211ULL;
+        Entry& entry = m_entries[hash % CAPACITY];
+        if (entry.color == size_t(-1) || entry.hash != hash || entry.tag != tag) {
+            entry.hash = hash;
+            entry.tag.assign(tag.data(), tag.size());
+            entry.color = hash % m_palette.size();
+            entry.open = m_palette[entry.color].str() + " ";
+        }
+        return entry;
+    }
+
+    const AnsiSequence& color(const Entry& entry) const { return m_palette[entry.color]; }
+
+    /*
+     Palette from LOGCAT_COLORIZE_TAG_PALETTE, a comma separated list of 256
+     color indexes or #rrggbb true colors, or else one suiting the terminal:
+     true colors when COLORTERM says so, 256 colors when TERM does, the 6
+     basic colors otherwise.
+    */
+    static vector<AnsiSequence> palette() {
+        vector<AnsiSequence> palette;
+        auto add = [&](const string& color) {
+            palette.push_back(AnsiSequence(Attribute::reset, Color::bdefault, color));
+        };
+
+        const char* value = getenv("LOGCAT_COLORIZE_TAG_PALETTE");
+        if (value && *value) {
+            static const boost::regex index("\\d{1,3}");
+            static const boost::regex rgb("#([[:xdigit:]]{2})([[:xdigit:]]{2})([[:xdigit:]]{2})");
+            vector<string> entries;
+            boost::split(entries, value, boost::is_any_of(","));
+            for (string& entry : entries) {
+                boost::trim(entry);
+                boost::smatch match;
+                if (boost::regex_match(entry, index) && stoi(entry) < 256)
+                    add("38;5;" + entry);
+                else if (boost::regex_match(entry, match, rgb))
+                    add("38;2;" + to_string(stoi(match[1], nullptr, 16)) + ";" +
+                        to_string(stoi(match[2], nullptr, 16)) + ";" + to_string(stoi(match[3], nullptr, 16)));
+                else
+                    throw runtime_error("invalid color '" + entry + "' in LOGCAT_COLORIZE_TAG_PALETTE");
+            }
+            return palette;
+        }
+
+        const char* colorTerm = getenv("COLORTERM");
+        const char* term = getenv("TERM");
+        if (colorTerm && (strcmp(colorTerm, "truecolor") == 0 || strcmp(colorTerm, "24bit") == 0)) {
+            // Evenly spaced hues, light enough for dark backgrounds.
+            const int hues = 24;
+            for (int i = 0; i < hues; i++) {
+                double h = 6.0*i/hues;
+                double x = 1 - fabs(fmod(h, 2) - 1);
+                double r = 0, g = 0, b = 0;
+                switch (static_cast<int>(h)) {
+                case 0: r = 1; g = x; break;
+                case 1: r = x; g = 1; break;
+                case 2: g = 1; b = x; break;
+                case 3: g = x; b = 1; break;
+                case 4: r = x; b = 1; break;
+                default: r = 1; b = x; break;
+                }
+                auto channel = [](double c) { return to_string(static_cast<int>(100 + c*155)); };
+                add("38;2;" + channel(r) + ";" + channel(g) + ";" + channel(b));
+            }
+        }
+        else if (term && strstr(term, "256color")) {
+            static const int indexes[] = {
+                33, 39, 45, 51, 49, 48, 82, 118, 154, 190, 226, 220, 214, 208, 202, 197,
+                199, 201, 165, 129, 93, 99, 105, 111, 117, 123, 159, 153, 183, 219, 217, 223
+            };
+            for (int i : indexes)
+                add("38;5;" + to_string(i));
+        }
+        else {
+            for (const string& color : { Color::fred, Color::fgreen, Color::fyellow,
+                                         Color::fblue, Color::fpurple, Color::fcyan })
+                add(color);
+        }
+        return palette;
+    }
+
+private:
+    vector<AnsiSequence> m_palette;
+    vector<Entry> m_entries;
+};
+
+/*
+ Predicate on the fields of a parsed line, compiled once from a --filter
+ expression such as:
+
+     level>=W && (tag~^Wifi || tag in {ActivityManager, WindowManager}) && pid==1234
+
+ Fields are date, level, tag, pid, tid and message. Levels are ordered
+ V < D < I < W < E < F, pid and tid compare as numbers, date and the other
+ fields as strings; ~ and !~ match a regular expression. Values may be
+ quoted with ' or " when they hold spaces or operators.
+*/
+class Filter
+{
+public:
+    Filter(const string& expression) : m_text(expression), m_pos(0) {
+        m_root = parseOr();
+        skipSpaces();
+        if (m_pos != m_text.size())
+            fail("unexpected '" + m_text.substr(m_pos) + "'");
+    }
+
+    bool accept(const Logcat& l) const { return m_root->eval(l); }
+
+    // Whether a line may be accepted, knowing only its date, level and tag.
+    bool mayAccept(const Logcat& l) const { return m_root->bound(l) != REJECT; }
+
+private:
+    enum Field { DATE, LEVEL, TAG, PID, TID, MESSAGE };
+    enum Op { EQ, NE, LT, LE, GT, GE, MATCH, NOT_MATCH, IN };
+    enum Bound { REJECT, ACCEPT, UNKNOWN };
+
+    struct Node {
+        virtual ~Node() {}
+        virtual bool eval(const Logcat& l) const = 0;
+        virtual Bound bound(const Logcat& l) const = 0;
+    };
+
+    struct And : public Node {
+        unique_ptr<Node> left, right;
+        virtual bool eval(const Logcat& l) const { return left->eval(l) && right->eval(l); }
+        virtual Bound bound(const Logcat& l) const {
+            Bound a = left->bound(l);
+            if (a == REJECT)
+                return REJECT;
+            Bound b = right->bound(l);
+            return b == REJECT ? REJECT : a == ACCEPT && b == ACCEPT ? ACCEPT : UNKNOWN;
+        }
+    };
+
+    struct Or : public Node {
+        unique_ptr<Node> left, right;
+        virtual bool eval(const Logcat& l) const { return left->eval(l) || right->eval(l); }
+        virtual Bound bound(const Logcat& l) const {
+            Bound a = left->bound(l);
+            if (a == ACCEPT)
+                return ACCEPT;
+            Bound b = right->bound(l);
+            return b == ACCEPT ? ACCEPT : a == REJECT && b == REJECT ? REJECT : UNKNOWN;
+        }
+    };
+
+    struct Not : public Node {
+        unique_ptr<Node> operand;
+        virtual bool eval(const Logcat& l) const { return !operand->eval(l); }
+        virtual Bound bound(const Logcat& l) const {
+            Bound a = operand->bound(l);
+            return a == UNKNOWN ? UNKNOWN : a == ACCEPT ? REJECT : ACCEPT;
+        }
+    };
+
+    // A comparison on a single field; pid, tid and message are unknown to
+    // bound().
+    struct Leaf : public Node {
+        Field field;
+        virtual Bound bound(const Logcat& l) const {
+            if (field == PID || field == TID || field == MESSAGE)
+                return UNKNOWN;
+            return eval(l) ? ACCEPT : REJECT;
+        }
+    };
+
+    // pid, tid and level compare as numbers.
+    struct NumberCompare : public Leaf {
+        Op op;
+        long value;
+        virtual bool eval(const Logcat& l) const {
+            long number;
+            if (!toNumber(field, l, number))
+                return false;
+            return compare(number < value ? -1 : number > value ? 1 : 0, op);
+        }
+    };
+
+    struct StringCompare : public Leaf {
+        Op op;
+        string value;
+        virtual bool eval(const Logcat& l) const {
+            return compare(get(field, l).compare(value), op);
+        }
+    };
+
+    struct Match : public Leaf {
+        bool negate;
+        boost::regex pattern;
+        virtual bool eval(const Logcat& l) const {
+            string_view text = get(field, l);
+            return boost::regex_search(text.begin(), text.end(), pattern) != negate;
+        }
+    };
+
+    // Sorted, so that lookups need no allocation.
+    struct In : public Leaf {
+        vector<string> values;
+        virtual bool eval(const Logcat& l) const {
+            string_view text = get(field, l);
+            return binary_search(values.begin(), values.end(), text,
+                                 [](string_view a, string_view b) { return a < b; });
+        }
+    };
+
+    // The text of a field; pid and tid without the padding some formats
+    // put before them, so that every operator sees the same number.
+    static string_view get(Field field, const Logcat& l) {
+        switch (field) {
+        case DATE: return l.date;
+        case LEVEL: return l.level;
+        case TAG: return l.tag;
+        case PID: return unpad(l.process);
+        case TID: return unpad(l.thread);
+        case MESSAGE: return l.message;
+        }
+        return string_view();
+    }
+
+    static string_view unpad(string_view text) {
+        size_t i = 0;
+        while (i < text.size() && text[i] == ' ')
+            i++;
+        return text.substr(i);
+    }
+
+    static bool toNumber(Field field, const Logcat& l, long& number) {
+        string_view text = get(field, l);
+        if (field == LEVEL) {
+            number = text.size() == 1 ? levelRank(text[0]) : -1;
+            return number >= 0;
+        }
+        if (text.empty())
+            return false;
+        number = 0;
+        for (size_t i = 0; i < text.size() && scan::isDigit(text[i]); i++)
+            number = number*10 + (text[i] - '0');
+        return true;
+    }
+
+    static long levelRank(char level) {
+        static const char levels[] = "VDIWEF";
+        const char* p = strchr(levels, toupper(static_cast<unsigned char>(level)));
+        return level && p ? p - levels : -1;
+    }
+
+    static bool compare(int order, Op op) {
+        switch (op) {
+        case EQ: return order == 0;
+        case NE: return order != 0;
+        case LT: return order < 0;
+        case LE: return order <= 0;
+        case GT: return order > 0;
+        case GE: return order >= 0;
+        default: return false;
+        }
+    }
+
+    unique_ptr<Node> parseOr() {
+        unique_ptr<Node> left = parseAnd();
+        while (accept("||")) {
+            unique_ptr<Or> node(new Or);
+            node->left = move(left);
+            node->right = parseAnd();
+            left = move(node);
+        }
+        return left;
+    }
+
+    unique_ptr<Node> parseAnd() {
+        unique_ptr<Node> left = parseUnary();
+        while (accept("&&")) {
+            unique_ptr<And> node(new And);
+            node->left = move(left);
+            node->right = parseUnary();
+            left = move(node);
+        }
+        return left;
+    }
+
+    unique_ptr<Node> parseUnary() {
+        if (accept("(")) {
+            unique_ptr<Node> node = parseOr();
+            if (!accept(")"))
+                fail("missing ')'");
+            return node;
+        }
+        // "!" but not the start of "!=" or "!~".
+        skipSpaces();
+        if (m_text.compare(m_pos, 1, "!") == 0 && m_text.compare(m_pos, 2, "!=") != 0 &&
+                m_text.compare(m_pos, 2, "!~") != 0) {
+            m_pos++;
+            unique_ptr<Not> node(new Not);
+            node->operand = parseUnary();
+            return node;
+        }
+        return parseComparison();
+    }
+
+    unique_ptr<Node> parseComparison() {
+        const string name = parseWord();
+        Field field;
+        if (name == "date") field = DATE;
+        else if (name == "level") field = LEVEL;
+        else if (name == "tag") field = TAG;
+        else if (name == "pid") field = PID;
+        else if (name == "tid") field = TID;
+        else if (name == "message" || name == "msg") field = MESSAGE;
+        else fail("unknown field '" + name + "'");
+
+        Op op = parseOp();
+        if (op == IN) {
+            unique_ptr<In> node(new In);
+            node->field = field;
+            if (!accept("{"))
+                fail("expected '{' after 'in'");
+            do {
+                node->values.push_back(parseValue());
+            } while (accept(","));
+            if (!accept("}"))
+                fail("missing '}'");
+            sort(node->values.begin(), node->values.end());
+            return node;
+        }
+
+        const string value = parseValue();
+        if (op == MATCH || op == NOT_MATCH) {
+            unique_ptr<Match> node(new Match);
+            node->field = field;
+            node->negate = op == NOT_MATCH;
+            node->pattern = value;
+            return node;
+        }
+
+        if (field == LEVEL || field == PID || field == TID) {
+            unique_ptr<NumberCompare> node(new NumberCompare);
+            node->field = field;
+            node->op = op;
+            if (field == LEVEL) {
+                node->value = value.size() == 1 ? levelRank(value[0]) : -1;
+                if (node->value < 0)
+                    fail("invalid level '" + value + "'");
+            }
+            else {
+                char* end;
+                node->value = strtol(value.c_str(), &end, 10);
+                if (value.empty() || *end)
+                    fail("invalid number '" + value + "'");
+            }
+            return node;
+        }
+
+        if (field != DATE && op != EQ && op != NE)
+            fail("only ==, !=, ~, !~ and in apply to '" + name + "'");
+        unique_ptr<StringCompare> node(new StringCompare);
+        node->field = field;
+        node->op = op;
+        node->value = value;
+        return node;
+    }
+
+    Op parseOp() {
+        static const struct {
+            const char* text;
+            Op op;
+        } ops[] = {
+            { "==", EQ }, { "!=", NE }, { "<=", LE }, { ">=", GE }, { "!~", NOT_MATCH },
+            { "<", LT }, { ">", GT }, { "~", MATCH }, { "=", EQ }
+        };
+        for (const auto& op : ops)
+            if (accept(op.text))
+                return op.op;
+        if (parseWord() == "in")
+            return IN;
+        fail("expected an operator");
+        return EQ;
+    }
+
+    string parseValue() {
+        skipSpaces();
+        if (m_pos < m_text.size() && (m_text[m_pos] == '\'' || m_text[m_pos] == '"')) {
+            char quote = m_text[m_pos++];
+            size_t end = m_text.find(quote, m_pos);
+            if (end == string::npos)
+                fail("unterminated string");
+            string value = m_text.substr(m_pos, end - m_pos);
+            m_pos = end + 1;
+            return value;
+        }
+        size_t start = m_pos;
+        while (m_pos < m_text.size() && !isspace(static_cast<unsigned char>(m_text[m_pos])) &&
+               !strchr("&|),}", m_text[m_pos]))
+            m_pos++;
+        if (start == m_pos)
+            fail("expected a value");
+        return m_text.substr(start, m_pos - start);
+    }
+
+    string parseWord() {
+        skipSpaces();
+        size_t start = m_pos;
+        while (m_pos < m_text.size() && isalpha(static_cast<unsigned char>(m_text[m_pos])))
+            m_pos++;
+        return m_text.substr(start, m_pos - start);
+    }
+
+    bool accept(const char* token) {
+        skipSpaces();
+        size_t size = strlen(token);
+        if (m_text.compare(m_pos, size, token) != 0)
+            return false;
+        m_pos += size;
+        return true;
+    }
+
+    void skipSpaces() {
+        while (m_pos < m_text.size() && isspace(static_cast<unsigned char>(m_text[m_pos])))
+            m_pos++;
+    }
+
+    [[noreturn]] void fail(const string& message) {
+        throw runtime_error("invalid filter: " + message);
+    }
+
+    string m_text;
+    size_t m_pos;
+    unique_ptr<Node> m_root;
+};
+
+class Format {
+
+protected:
+    Logcat l;
+    boost::regex pattern;
+    shared_ptr<const Spotlight> spotlight;
+    boost::cmatch match(string_view raw) {
+        boost::cmatch results;
+        boost::match_flag_type flags = boost::match_default;
+        boost::regex_search(raw.data(), raw.data() + raw.size(), results, this->pattern, flags);
+        return results;
+    }
+
+    static string_view slice(const boost::csub_match& match) {
+        if (!match.matched)
+            return string_view();
+        return scan::slice(match.first, match.second);
+    }
+
+    // Fills l from the regular expression.
+    virtual void parseRegex(string_view raw) = 0;
+    // Fills l with the scanner; returns false and leaves l undefined when the
+    // line does not match.
+    virtual bool scan(const char* begin, const char* end) = 0;
+
+public:
+    void setSpotlight(const shared_ptr<const Spotlight>& spotlight) {
+        this->spotlight = spotlight;
+    }
+
+    void setTagColors(const vector<AnsiSequence>& palette) {
+        tagColors = TagColors(palette);
+    }
+
+    const int type = -1;
+    Format(const string& pattern) {
+        this->l = Logcat { /*date   */ "",
+                           /*level  */ "",
+                           /*tag    */ "",
+                           /*process*/ "",
+                           /*message*/ "",
+                           /*thread */ "" };
+        this->pattern = pattern;
+    }
+
+    virtual ~Format() {};
+    static const int BRIEF;
+    static const int PROCESS;
+    static const int TAG;
+    static const int RAW;
+    static const int TIME;
+    static const int THREADTIME;
+    static const int LONG;
+
+    static AnsiSequence ID_VERBOSE;
+    static AnsiSequence ID_DEBUG;
+    static AnsiSequence ID_INFO;
+    static AnsiSequence ID_WARNING;
+    static AnsiSequence ID_ERROR;
+    static AnsiSequence ID_FATAL;
+    static AnsiSequence MSG_VERBOSE;
+    static AnsiSequence MSG_DEBUG;
+    static AnsiSequence MSG_INFO;
+    static AnsiSequence MSG_WARNING;
+    static AnsiSequence MSG_ERROR;
+    static AnsiSequence MSG_FATAL;
+    static AnsiSequence TID_PID;
+    static AnsiSequence FIELD_DATE;
+    static AnsiSequence FIELD_TAG;
+    static AnsiSequence RESET;
+
+    static const int PARSER_SCANNER;
+    static const int PARSER_REGEX;
+    static const int PARSER_VERIFY;
+    static int parser;
+    static atomic<unsigned long> mismatches;
+
+    static const int OUTPUT_COLOR;
+    static const int OUTPUT_JSON;
+    static int output;
+
+    // Fields a format always fills, for render(); tags and messages may be
+    // empty in any format.
+    static const unsigned HAS_DATE    = 1;
+    static const unsigned HAS_LEVEL   = 2;
+    static const unsigned HAS_PROCESS = 4;
+    static const unsigned HAS_THREAD  = 8;
+    static const unsigned ANY_FIELDS  = ~0u;
+    static const unsigned FIELDS      = ANY_FIELDS;
+
+    void parse(string_view raw) {
+        parse(raw, scan::hasSeparator(raw.data(), raw.data() + raw.size()));
+    }
+
+    // Same as parse(raw), when the caller already knows whether the line
+    // holds line separators.
+    void parse(string_view raw, bool hasSeparator) {
+        if (parser == PARSER_REGEX || hasSeparator) {
+            parseRegex(raw);
+            return;
+        }
+
+        if (!scan(raw.data(), raw.data() + raw.size()))
+            this->l = Logcat();
+
+        if (parser == PARSER_VERIFY) {
+            // The regex result is the reference: report and keep it.
+            Logcat scanned = this->l;
+            parseRegex(raw);
+            if (!(scanned == this->l)) {
+                mismatches++;
+                cerr << "Scanner mismatch: " << raw << endl;
+            }
+        }
+    }
+    virtual bool valid() { return false; }
+    // Whether the line parsed yields a record to print, which lines only
+    // delimiting a multi-line entry do not.
+    virtual bool hasRecord() const { return true; }
+    const Logcat& record() const { return l; }
+    // Copy sharing the configuration, for use on another thread.
+    virtual Format* clone() const = 0;
+
+    void print(Output& out) {
+        print(out, this->l);
+    }
+
+    // Renders a record, which may come from elsewhere than parse().
+    void print(Output& out, const Logcat& l) {
+        render<ANY_FIELDS>(out, l);
+    }
+
+    /*
+     Same as print(), for records of a format always filling the FILLED
+     fields and no other but tag and message: the checks for empty fields
+     are then resolved at compile time.
+    */
+    template<unsigned FILLED>
+    void render(Output& out, const Logcat& l) {
+        if (output == OUTPUT_JSON) {
+            printJson<FILLED>(out, l);
+            return;
+        }
+
+        const RenderTemplate& t = TEMPLATE;
+        const RenderTemplate::Level& level =
+                t.levels[l.level.size() == 1 ? static_cast<unsigned char>(l.level[0]) : 0];
+
+        // date
+        if (has<FILLED>(HAS_DATE, l.date)) {
+            out << t.dateOpen;
+            spotIfNeeded(out, l.date, FIELD_DATE);
+            out << t.dateClose;
+        }
+
+        // level
+        if (has<FILLED>(HAS_LEVEL, l.level))
+            out << level.id;
+
+        // process/thread
+        if (has<FILLED>(HAS_PROCESS, l.process)) {
+            if (!spotlight) {
+                out << t.processOpen << l.process;
+                if (has<FILLED>(HAS_THREAD, l.thread))
+                    out << t.threadOpen << l.thread;
+                out << t.processClose;
+            }
+            else {
+                // The spotlight may span the whole block, so it is matched
+                // against a copy. The buffer is reused across lines.
+                processThread.assign("[").append(l.process);
+                if (has<FILLED>(HAS_THREAD, l.thread))
+                    processThread.append("/").append(l.thread);
+                processThread.append("]");
+                out << TID_PID;
+                spotIfNeeded(out, processThread, TID_PID);
+                out << RESET;
+            }
+        }
+
+        // tag
+        if (!l.tag.empty()) {
+            if (tagColors.enabled()) {
+                const TagColors::Entry& entry = tagColors.lookup(l.tag);
+                out << entry.open;
+                spotIfNeeded(out, l.tag, tagColors.color(entry));
+            }
+            else {
+                out << t.tagOpen;
+                spotIfNeeded(out, l.tag, FIELD_TAG);
+            }
+            out << t.tagClose;
+        }
+
+        // message
+        if (!l.message.empty()) {
+            out << level.messageOpen;
+            spotIfNeeded(out, l.message, *level.message);
+        }
+
+        out << t.lineEnd;
+        out.endLine();
+    }
+
+    // One object per line, without the fields the format of the record
+    // lacks; there is always a message. The summary of a record collapsed
+    // by --collapse has the number of repeats in a "repeated" key.
+    template<unsigned FILLED>
+    static void printJson(Output& out, const Logcat& l, size_t repeated = 0) {
+        char separator = '{';
+        auto key = [&](const char* name, size_t size) {
+            out.append(separator);
+            out.append(name, size);
+            separator = ',';
+        };
+        if (has<FILLED>(HAS_DATE, l.date)) {
+            key("\"date\":", 7);
+            json::quote(out, l.date);
+        }
+        if (has<FILLED>(HAS_LEVEL, l.level)) {
+            key("\"level\":", 8);
+            json::quote(out, l.level);
+        }
+        if (!l.tag.empty()) {
+            key("\"tag\":", 6);
+            json::quote(out, l.tag);
+        }
+        if (has<FILLED>(HAS_PROCESS, l.process)) {
+            key("\"pid\":", 6);
+            json::id(out, l.process);
+        }
+        if (has<FILLED>(HAS_THREAD, l.thread)) {
+            key("\"tid\":", 6);
+            json::id(out, l.thread);
+        }
+        key("\"message\":", 10);
+        json::quote(out, l.message);
+        if (repeated) {
+            char digits[24];
+            key("\"repeated\":", 11);
+            out.append(digits, snprintf(digits, sizeof(digits), "%zu", repeated));
+        }
+        out.append('}');
+        out.endLine();
+    }
+
+    // Prints a line in no known format as it is.
+    static void printRaw(Output& out, string_view line) {
+        if (output == OUTPUT_JSON) {
+            out.append("{\"raw\":", 7);
+            json::quote(out, line);
+            out.append('}');
+        }
+        else
+            out << line;
+        out.endLine();
+    }
+
+    // Reads the LOGCAT_COLORIZE_* variables. Call once, before parsing.
+    static void parseConfiguration() {
+
+#define RESET_FORMAT(level) \
+    reset_format("LOGCAT_COLORIZE_" #level, level)
+
+        RESET_FORMAT(ID_DEBUG);
+        RESET_FORMAT(ID_VERBOSE);
+        RESET_FORMAT(ID_INFO);
+        RESET_FORMAT(ID_WARNING);
+        RESET_FORMAT(ID_ERROR);
+        RESET_FORMAT(ID_FATAL);
+        RESET_FORMAT(MSG_DEBUG);
+        RESET_FORMAT(MSG_VERBOSE);
+        RESET_FORMAT(MSG_INFO);
+        RESET_FORMAT(MSG_WARNING);
+        RESET_FORMAT(MSG_ERROR);
+        RESET_FORMAT(MSG_FATAL);
+        RESET_FORMAT(TID_PID);
+
+        buildTemplate();
+    }
+
+private:
+    /*
+     Byte sequences surrounding the fields of a rendered line, with the
+     configured escape sequences baked in, so that printing a record only
+     copies bytes. Level dependent parts are indexed by the level character.
+    */
+    struct RenderTemplate {
+        struct Level {
+            string id;
+            string messageOpen;
+            const AnsiSequence* message;
+        };
+
+        string dateOpen;
+        string dateClose;
+        string processOpen;
+        string threadOpen;
+        string processClose;
+        string tagOpen;
+        string tagClose;
+        string lineEnd;
+        Level levels[256];
+    };
+
+    static RenderTemplate TEMPLATE;
+
+    static void buildTemplate() {
+        RenderTemplate& t = TEMPLATE;
+        t.dateOpen = FIELD_DATE.str() + " ";
+        t.dateClose = " " + RESET.str();
+        t.processOpen = TID_PID.str() + "[";
+        t.threadOpen = "/";
+        t.processClose = "]" + RESET.str();
+        t.tagOpen = FIELD_TAG.str() + " ";
+        t.tagClose = RESET.str();
+        t.lineEnd = RESET.str();
+
+        const struct {
+            char level;
+            const AnsiSequence& id;
+            const AnsiSequence& message;
+        } known[] = {
+            { 'V', ID_VERBOSE, MSG_VERBOSE },
+            { 'D', ID_DEBUG, MSG_DEBUG },
+            { 'I', ID_INFO, MSG_INFO },
+            { 'W', ID_WARNING, MSG_WARNING },
+            { 'E', ID_ERROR, MSG_ERROR },
+            { 'F', ID_FATAL, MSG_FATAL }
+        };
+        for (RenderTemplate::Level& level : t.levels) {
+            level.id = " ";
+            level.messageOpen = " ";
+            level.message = &RESET;
+        }
+        for (const auto& k : known) {
+            RenderTemplate::Level& level = t.levels[static_cast<unsigned char>(k.level)];
+            level.id = k.id.str() + " " + k.level + " " + RESET.str() + " ";
+            level.messageOpen = " " + k.message.str();
+            level.message = &k.message;
+        }
+    }
+
+    // Whether a record of a format filling FILLED holds field.
+    template<unsigned FILLED>
+    static bool has(unsigned field, string_view value) {
+        return FILLED == ANY_FIELDS ? !value.empty() : (FILLED & field) != 0;
+    }
+
+    static void reset_format(const string& envVarName, AnsiSequence& ansiSequence)
+    {
+        boost::optional<AnsiSequence> custom = parseEscapeSequenceVariable(envVarName);
+        if (custom)
+            ansiSequence = custom.get();
+    }
+
+    void spotIfNeeded(Output& out, string_view log, const AnsiSequence& resume) {
+        if (spotlight)
+            spotlight->highlight(out, log, resume);
+        else
+            out << log;
+    }
+
+    string processThread;
+    TagColors tagColors;
+};
+
+const int Format::BRIEF      = 0;
+const int Format::PROCESS    = 1;
+const int Format::TAG        = 2;
+const int Format::RAW        = 3;
+const int Format::TIME       = 4;
+const int Format::THREADTIME = 5;
+const int Format::LONG       = 6;
+
+const int Format::PARSER_SCANNER = 0;
+const int Format::PARSER_REGEX   = 1;
+const int Format::PARSER_VERIFY  = 2;
+int Format::parser               = Format::PARSER_SCANNER;
+
+const int Format::OUTPUT_COLOR = 0;
+const int Format::OUTPUT_JSON  = 1;
+int Format::output             = Format::OUTPUT_COLOR;
+atomic<unsigned long> Format::mismatches(0);
+
+AnsiSequence Format::ID_VERBOSE = AnsiSequence(Attribute::bold, Color::bcyan, Color::fwhite);
+AnsiSequence Format::ID_DEBUG   = AnsiSequence(Attribute::bold, Color::bblue, Color::fwhite);
+AnsiSequence Format::ID_INFO    = AnsiSequence(Attribute::bold, Color::bgreen, Color::fwhite);
+AnsiSequence Format::ID_WARNING = AnsiSequence(Attribute::bold, Color::byellow, Color::fwhite);
+AnsiSequence Format::ID_ERROR   = AnsiSequence(Attribute::bold, Color::bred, Color::fwhite);
+AnsiSequence Format::ID_FATAL   = ID_ERROR;
+
+AnsiSequence Format::MSG_VERBOSE = AnsiSequence(Attribute::reset, Color::bdefault, Color::fcyan);
+AnsiSequence Format::MSG_DEBUG   = AnsiSequence(Attribute::reset, Color::bdefault, Color::fblue);
+AnsiSequence Format::MSG_INFO    = AnsiSequence(Attribute::reset, Color::bdefault, Color::fgreen);
+AnsiSequence Format::MSG_WARNING = AnsiSequence(Attribute::reset, Color::bdefault, Color::fyellow);
+AnsiSequence Format::MSG_ERROR   = AnsiSequence(Attribute::reset, Color::bdefault, Color::fred);
+AnsiSequence Format::MSG_FATAL   = MSG_ERROR;
+
+AnsiSequence Format::TID_PID     = AnsiSequence(Attribute::reset, Color::bblack, Color::fcyan);
+AnsiSequence Format::FIELD_DATE  = AnsiSequence(Attribute::reset, Color::bdefault, Color::fpurple);
+AnsiSequence Format::FIELD_TAG   = AnsiSequence(Attribute::reset, Color::bdefault, Color::fwhite);
+
+AnsiSequence Format::RESET       = AnsiSequenceReset();
+
+Format::RenderTemplate Format::TEMPLATE;
+
+class Tag final : public Format {
+    friend class Formats;
+
+public:
+    const int type = Format::TAG;
+    static const unsigned FIELDS = HAS_LEVEL;
+    Tag() : Format("^([VDIWEF])/(.*?): (.*)$") {}
+    ~Tag() {}
+    virtual Format* clone() const { return new Tag(*this); }
+    virtual bool valid() {
+        return this->l.level != "";
+    }
+
+protected:
+    __attribute__((noinline)) virtual bool scan(const char* begin, const char* end) {
+        if (end - begin < 2 || !scan::isLevel(begin[0]) || begin[1] != '/')
+            return false;
+        const char* sep = scan::findColonSpace(begin + 2, end);
+        if (!sep)
+            return false;
+        this->l.date = string_view();
+        this->l.level = string_view(begin, 1);
+        this->l.message = scan::slice(sep + 2, end);
+        this->l.process = string_view();
+        this->l.tag = scan::slice(begin + 2, sep);
+        this->l.thread = string_view();
+        return true;
+    }
+    virtual void parseRegex(string_view raw) {
+        boost::cmatch matches = this->match(raw);
+        if (matches.size() >= 3) {
+            this->l.date = "";
+            this->l.level = slice(matches[1]);
+            this->l.message = slice(matches[3]);
+            this->l.process = "";
+            this->l.tag = slice(matches[2]);
+            this->l.thread = "";
+        }
+    }
+};
+
+class Process final : public Format {
+    friend class Formats;
+
+public:
+    const int type = Format::PROCESS;
+    static const unsigned FIELDS = HAS_LEVEL | HAS_PROCESS;
+    Process() : Format("^([VDIWEF])\\(([ 0-9]{1,})\\) (.*) \\(((.*?))\\)$") {}
+    ~Process() {}
+    virtual Format* clone() const { return new Process(*this); }
+    virtual bool valid() {
+        return this->l.level != "" && this->l.process != "";
+    }
+
+protected:
+    __attribute__((noinline)) virtual bool scan(const char* begin, const char* end) {
+        if (end - begin < 2 || !scan::isLevel(begin[0]) || begin[1] != '(')
+            return false;
+        const char* pid = begin + 2;
+        const char* p = pid;
+        while (p != end && scan::isPidChar(*p))
+            ++p;
+        if (p == pid || end - p < 2 || p[0] != ')' || p[1] != ' ')
+            return false;
+        const char* msg = p + 2;
+
+        // The message is greedy: the tag opens at the last " (" and closes
+        // with the final ')'.
+        if (end[-1] != ')')
+            return false;
+        const char* open = nullptr;
+        for (const char* q = end - 3; q >= msg; --q) {
+            if (q[0] == ' ' && q[1] == '(') {
+                open = q;
+                break;
+            }
+        }
+        if (!open)
+            return false;
+        this->l.date = string_view();
+        this->l.level = string_view(begin, 1);
+        this->l.message = scan::slice(msg, open);
+        this->l.process = scan::slice(pid, p);
+        this->l.tag = scan::slice(open + 2, end - 1);
+        this->l.thread = string_view();
+        return true;
+    }
+    virtual void parseRegex(string_view raw) {
+        boost::cmatch matches = this->match(raw);
+        if (matches.size() >= 4) {
+            this->l.date = "";
+            this->l.level = slice(matches[1]);
+            this->l.message = slice(matches[3]);
+            this->l.process = slice(matches[2]);
+            this->l.tag = slice(matches[4]);
+            this->l.thread = "";
+        }
+    }
+};
+
+
+class Brief final : public Format {
+    friend class Formats;
+
+public:
+    const int type = Format::BRIEF;
+    static const unsigned FIELDS = HAS_LEVEL | HAS_PROCESS;
+    Brief() : Format("^([VDIWEF])/(.*?)\\(([ 0-9]{1,})\\): (.*)$") {}
+    ~Brief() {}
+    virtual Format* clone() const { return new Brief(*this); }
+    virtual bool valid() {
+        return this->l.level != "" && this->l.process != "";
+    }
+
+protected:
+    __attribute__((noinline)) virtual bool scan(const char* begin, const char* end) {
+        if (end - begin < 2 || !scan::isLevel(begin[0]) || begin[1] != '/')
+            return false;
+
+        // The tag is lazy: it ends at the first "(pid): ".
+        const char* tag = begin + 2;
+        for (const char* open = tag; open < end; ++open) {
+            open = static_cast<const char*>(memchr(open, '(', end - open));
+            if (!open)
+                return false;
+            const char* pid = open + 1;
+            const char* p = pid;
+            while (p != end && scan::isPidChar(*p))
+                ++p;
+            if (p == pid || end - p < 3 || p[0] != ')' || p[1] != ':' || p[2] != ' ')
+                continue;
+            this->l.date = string_view();
+            this->l.level = string_view(begin, 1);
+            this->l.message = scan::slice(p + 3, end);
+            this->l.process = scan::slice(pid, p);
+            this->l.tag = scan::slice(tag, open);
+            this->l.thread = string_view();
+            return true;
+        }
+        return false;
+    }
+    virtual void parseRegex(string_view raw) {
+        boost::cmatch matches = this->match(raw);
+        if (matches.size() >= 5) {
+            this->l.date = "";
+            this->l.level = slice(matches[1]);
+            this->l.message = slice(matches[4]);
+            this->l.process = slice(matches[3]);
+            this->l.tag = slice(matches[2]);
+            this->l.thread = "";
+        }
+    }
+};
+
+class Time final : public Format {
+    friend class Formats;
+
+public:
+    const int type = Format::TIME;
+    static const unsigned FIELDS = HAS_DATE | HAS_LEVEL | HAS_PROCESS;
+    Time() : Format("^([0-9]{2}-[0-9]{2} [0-9]{2}:[0-9]{2}:[0-9]{2}.[0-9]{3}):? ([VDIWEF])/(.*?)\\(([ 0-9]{1,})\\)\\s*: (.*)$") {}
+    ~Time() {}
+    virtual Format* clone() const { return new Time(*this); }
+    virtual bool valid() {
+        return this->l.date != "" && this->l.level != "" && this->l.process != "";
+    }
+
+protected:
+    __attribute__((noinline)) virtual bool scan(const char* begin, const char* end) {
+        if (!scan::isDate(begin, end))
+            return false;
+        const char* p = begin + scan::DATE_LENGTH;
+        if (p != end && *p == ':' && p + 1 != end && p[1] == ' ')
+            p += 2;
+        else if (p != end && *p == ' ')
+            p += 1;
+        else
+            return false;
+        if (end - p < 2 || !scan::isLevel(p[0]) || p[1] != '/')
+            return false;
+        const char* level = p;
+
+        // The tag is lazy: it ends at the first "(pid)\s*: ".
+        const char* tag = p + 2;
+        for (const char* open = tag; open < end; ++open) {
+            open = static_cast<const char*>(memchr(open, '(', end - open));
+            if (!open)
+                return false;
+            const char* pid = open + 1;
+            const char* q = pid;
+            while (q != end && scan::isPidChar(*q))
+                ++q;
+            if (q == pid || q == end || *q != ')')
+                continue;
+            const char* pidEnd = q++;
+            while (q != end && scan::isSpace(*q))
+                ++q;
+            if (end - q < 2 || q[0] != ':' || q[1] != ' ')
+                continue;
+            this->l.date = string_view(begin, scan::DATE_LENGTH);
+            this->l.level = string_view(level, 1);
+            this->l.message = scan::slice(q + 2, end);
+            this->l.process = scan::slice(pid, pidEnd);
+            this->l.tag = scan::slice(tag, open);
+            this->l.thread = string_view();
+            return true;
+        }
+        return false;
+    }
+    virtual void parseRegex(string_view raw) {
+        boost::cmatch matches = this->match(raw);
+        if (matches.size() >= 6) {
+            this->l.date = slice(matches[1]);
+            this->l.level = slice(matches[2]);
+            this->l.message = slice(matches[5]);
+            this->l.process = slice(matches[4]);
+            this->l.tag = slice(matches[3]);
+            this->l.thread = "";
+        }
+    }
+};
+
+class ThreadTime final : public Format {
+    friend class Formats;
+
+public:
+    const int type = Format::THREADTIME;
+    static const unsigned FIELDS = HAS_DATE | HAS_LEVEL | HAS_PROCESS | HAS_THREAD;
+    ThreadTime() : Format("^([0-9]{2}-[0-9]{2} [0-9]{2}:[0-9]{2}:[0-9]{2}.[0-9]{3})[[:space:]]*([0-9]{1,})[[:space:]]*([0-9]{1,}) ([VDIWEF]) (.*?): (.*)$") {}
+    ~ThreadTime() {}
+    virtual Format* clone() const { return new ThreadTime(*this); }
+    virtual bool valid() {
+        return this->l.date != "" && this->l.level != "" && this->l.process != "" && this->l.thread != "";
+    }
+
+protected:
+    __attribute__((noinline)) virtual bool scan(const char* begin, const char* end) {
+        if (!scan::isDate(begin, end))
+            return false;
+        const char* pid = begin + scan::DATE_LENGTH;
+        while (pid != end && scan::isSpace(*pid))
+            ++pid;
+        const char* digitsEnd = pid;
+        while (digitsEnd != end && scan::isDigit(*digitsEnd))
+            ++digitsEnd;
+        if (digitsEnd == pid)
+            return false;
+
+        // Usual case: pid, spaces, tid.
+        const char* tid = digitsEnd;
+        while (tid != end && scan::isSpace(*tid))
+            ++tid;
+        const char* tidEnd = tid;
+        while (tidEnd != end && scan::isDigit(*tidEnd))
+            ++tidEnd;
+        if (tidEnd != tid && scanTail(begin, pid, digitsEnd, tid, tidEnd, end))
+            return true;
+
+        // Backtracking: pid and tid split a single run of digits.
+        for (const char* split = digitsEnd - 1; split > pid; --split) {
+            if (scanTail(begin, pid, split, split, digitsEnd, end))
+                return true;
+        }
+        return false;
+    }
+
+    // Matches " ([VDIWEF]) (.*?): (.*)$" after the tid.
+    bool scanTail(const char* begin, const char* pid, const char* pidEnd,
+                  const char* tid, const char* tidEnd, const char* end) {
+        const char* p = tidEnd;
+        if (end - p < 3 || p[0] != ' ' || !scan::isLevel(p[1]) || p[2] != ' ')
+            return false;
+        const char* tag = p + 3;
+        const char* sep = scan::findColonSpace(tag, end);
+        if (!sep)
+            return false;
+        this->l.date = string_view(begin, scan::DATE_LENGTH);
+        this->l.level = string_view(p + 1, 1);
+        this->l.message = scan::slice(sep + 2, end);
+        this->l.process = scan::slice(pid, pidEnd);
+        this->l.tag = scan::slice(tag, sep);
+        this->l.thread = scan::slice(tid, tidEnd);
+        return true;
+    }
+
+    virtual void parseRegex(string_view raw) {
+        boost::cmatch matches = this->match(raw);
+        if (matches.size() >= 7) {
+            this->l.date = slice(matches[1]);
+            this->l.level = slice(matches[4]);
+            this->l.message = slice(matches[6]);
+            this->l.process = slice(matches[2]);
+            this->l.tag = slice(matches[5]);
+            this->l.thread = slice(matches[3]);
+        }
+    }
+};
+
+
+/*
+ Multi-line entries of adb logcat -v long: a "[ date pid:tid level/tag ]"
+ header, the lines of the message and a blank line. The header fields are
+ kept and every message line becomes a record of its own carrying them, so
+ entries are colorized as they stream whatever their length. Header lines
+ and separators print nothing, except for an entry without any message.
+*/
+class Long : public Format {
+
+public:
+    const int type = Format::LONG;
+    Long() : Format("^\\[ ([0-9]{2}-[0-9]{2} [0-9]{2}:[0-9]{2}:[0-9]{2}.[0-9]{3})[[:space:]]+([0-9]+):[[:space:]]*(0x[0-9a-fA-F]+|[0-9]+) ([VDIWEF])/(.*?)[[:space:]]*\\]$"),
+        m_active(false), m_lines(0), m_hasRecord(false) {}
+    // The entry in progress, if any, is not shared with the copy.
+    Long(const Long& other) : Format(other), m_active(false), m_lines(0), m_hasRecord(false) {
+        this->l = Logcat();
+    }
+    ~Long() {}
+    virtual Format* clone() const { return new Long(*this); }
+    virtual bool valid() {
+        return this->l.date != "" && this->l.level != "" && this->l.process != "" && this->l.thread != "";
+    }
+    virtual bool hasRecord() const { return m_hasRecord; }
+
+    // Whether lines belong to an entry whose header was parsed.
+    bool active() const { return m_active; }
+
+    // Starts an entry from the header just parsed.
+    void begin() {
+        m_date.assign(this->l.date.data(), this->l.date.size());
+        m_level.assign(this->l.level.data(), this->l.level.size());
+        m_tag.assign(this->l.tag.data(), this->l.tag.size());
+        m_process.assign(this->l.process.data(), this->l.process.size());
+        m_thread.assign(this->l.thread.data(), this->l.thread.size());
+        this->l = Logcat { m_date, m_level, m_tag, m_process, "", m_thread };
+        m_active = true;
+        m_lines = 0;
+        m_hasRecord = false;
+    }
+
+    // Drops the entry in progress.
+    void end() {
+        m_active = false;
+        m_hasRecord = false;
+    }
+
+    // Parses a line following the header.
+    void next(string_view line) {
+        if (line.empty()) {
+            m_active = false;
+            m_hasRecord = m_lines == 0;
+            this->l.message = string_view();
+            return;
+        }
+        m_lines++;
+        m_hasRecord = true;
+        this->l.message = line;
+    }
+
+protected:
+    virtual bool scan(const char* begin, const char* end) {
+        if (end - begin < 2 || begin[0] != '[' || begin[1] != ' ' || !scan::isDate(begin + 2, end))
+            return false;
+        const char* date = begin + 2;
+        const char* pid = date + scan::DATE_LENGTH;
+        if (pid == end || !scan::isSpace(*pid))
+            return false;
+        while (pid != end && scan::isSpace(*pid))
+            ++pid;
+        const char* pidEnd = pid;
+        while (pidEnd != end && scan::isDigit(*pidEnd))
+            ++pidEnd;
+        if (pidEnd == pid || pidEnd == end || *pidEnd != ':')
+            return false;
+
+        const char* tid = pidEnd + 1;
+        while (tid != end && scan::isSpace(*tid))
+            ++tid;
+        const char* tidEnd = tid;
+        if (end - tid > 2 && tid[0] == '0' && tid[1] == 'x' && isxdigit(static_cast<unsigned char>(tid[2]))) {
+            tidEnd = tid + 2;
+            while (tidEnd != end && isxdigit(static_cast<unsigned char>(*tidEnd)))
+                ++tidEnd;
+        }
+        else {
+            while (tidEnd != end && scan::isDigit(*tidEnd))
+                ++tidEnd;
+        }
+        if (tidEnd == tid)
+            return false;
+
+        // " L/tag ]" up to the end of the line.
+        const char* p = tidEnd;
+        if (end - p < 4 || p[0] != ' ' || !scan::isLevel(p[1]) || p[2] != '/' || end[-1] != ']')
+            return false;
+        const char* tag = p + 3;
+        const char* tagEnd = end - 1;
+        while (tagEnd > tag && scan::isSpace(tagEnd[-1]))
+            --tagEnd;
+
+        this->l.date = string_view(date, scan::DATE_LENGTH);
+        this->l.level = string_view(p + 1, 1);
+        this->l.message = string_view();
+        this->l.process = scan::slice(pid, pidEnd);
+        this->l.tag = scan::slice(tag, tagEnd);
+        this->l.thread = scan::slice(tid, tidEnd);
+        return true;
+    }
+
+    virtual void parseRegex(string_view raw) {
+        boost::cmatch matches = this->match(raw);
+        if (matches.size() >= 6) {
+            this->l.date = slice(matches[1]);
+            this->l.level = slice(matches[4]);
+            this->l.message = string_view();
+            this->l.process = slice(matches[2]);
+            this->l.tag = slice(matches[5]);
+            this->l.thread = slice(matches[3]);
+        }
+    }
+
+private:
+    bool m_active;
+    size_t m_lines;
+    bool m_hasRecord;
+    string m_date;
+    string m_level;
+    string m_tag;
+    string m_process;
+    string m_thread;
+};
+
+/*
+ One instance of each known format, built once. Every line is classified by
+ its first bytes and parsed by the formats it can belong to, most specific
+ first, so streams mixing several formats are colorized line by line.
+*/
+class Formats
+{
+public:
+    Formats() {
+        m_threadTime.reset(new ThreadTime());
+        m_time.reset(new Time());
+        m_brief.reset(new Brief());
+        m_process.reset(new Process());
+        m_tag.reset(new Tag());
+        m_long.reset(new Long());
+    }
+
+    // Copy for use on another thread.
+    Formats(const Formats& other) {
+        m_threadTime.reset(new ThreadTime(*other.m_threadTime));
+        m_time.reset(new Time(*other.m_time));
+        m_brief.reset(new Brief(*other.m_brief));
+        m_process.reset(new Process(*other.m_process));
+        m_tag.reset(new Tag(*other.m_tag));
+        m_long.reset(new Long(*other.m_long));
+    }
+
+    void setSpotlight(const shared_ptr<const Spotlight>& spotlight) {
+        for (Format* f : all())
+            f->setSpotlight(spotlight);
+    }
+
+    // Only the format rendering every record needs the table of tags.
+    void setTagColors(const vector<AnsiSequence>& palette) {
+        m_threadTime->setTagColors(palette);
+    }
+
+    // Forgets the -v long entry in progress, before lines which do not
+    // follow the previous ones.
+    void reset() {
+        m_long->end();
+    }
+
+    // Renders a record decoded elsewhere; all formats render alike.
+    void print(Output& out, const Logcat& record) {
+        m_threadTime->print(out, record);
+    }
+
+    // Same as print() for a record of a format filling FILLED.
+    template<unsigned FILLED>
+    void render(Output& out, const Logcat& record) {
+        m_threadTime->render<FILLED>(out, record);
+    }
+
+    // Returns the format that parsed the line, or nullptr. Lines following
+    // a -v long header belong to its entry.
+    Format* parse(string_view line) {
+        if (m_long->active()) {
+            m_long->next(line);
+            return m_long.get();
+        }
+        if (line.size() < 2)
+            return nullptr;
+        if (line[0] == '[') {
+            Format* f = parse(line, m_long.get());
+            if (f)
+                m_long->begin();
+            return f;
+        }
+        if (scan::isDigit(line[0]))
+            return parse(line, m_threadTime.get(), m_time.get());
+        if (!scan::isLevel(line[0]))
+            return nullptr;
+        if (line[1] == '/')
+            return parse(line, m_brief.get(), m_tag.get());
+        if (line[1] == '(')
+            return parse(line, m_process.get());
+        return nullptr;
+    }
+
+    /*
+     Same as parse(line) for lines expected in the format f, which scans
+     them without any virtual call nor validity check: scanned fields are
+     never empty. Returns nullptr for lines needing parse(line): in another
+     format, within a -v long entry, or not for the scanner alone. The
+     scanners are kept out of line: inlined into the loop, they made it
+     slower than the virtual calls on brief and process lines.
+    */
+    template<class F>
+    F* scanAs(F* f, string_view line) {
+        const char* begin = line.data();
+        const char* end = begin + line.size();
+        if (Format::parser != Format::PARSER_SCANNER || m_long->active() ||
+                scan::hasSeparator(begin, end) || !f->F::scan(begin, end))
+            return nullptr;
+        // Lines also in the format tried first belong to that one.
+        if constexpr (is_same<F, Time>::value) {
+            if (m_threadTime->ThreadTime::scan(begin, end))
+                return nullptr;
+        }
+        if constexpr (is_same<F, Tag>::value) {
+            if (m_brief->Brief::scan(begin, end))
+                return nullptr;
+        }
+        return f;
+    }
+
+    // The format of the first of the lines in data which is in one, among
+    // those filling a fixed set of fields, or nullptr. Only DETECT_LINES
+    // lines are tried.
+    Format* detect(string_view data) {
+        LineReader lines(data);
+        string_view line;
+        for (int i = 0; i < DETECT_LINES && lines.next(line); i++) {
+            if (line.size() < 2 || line[0] == '[')
+                continue;
+            Format* f = nullptr;
+            if (scan::isDigit(line[0]))
+                f = parse(line, m_threadTime.get(), m_time.get());
+            else if (scan::isLevel(line[0]) && line[1] == '/')
+                f = parse(line, m_brief.get(), m_tag.get());
+            else if (scan::isLevel(line[0]) && line[1] == '(')
+                f = parse(line, m_process.get());
+            if (f)
+                return f;
+        }
+        return nullptr;
+    }
+
+    // Calls loop with f as its own type, or with a null Format* when f is
+    // not one of those detect() returns.
+    template<class Loop>
+    void dispatch(Format* f, Loop&& loop) {
+        if (f == m_threadTime.get())
+            loop(m_threadTime.get());
+        else if (f == m_time.get())
+            loop(m_time.get());
+        else if (f == m_brief.get())
+            loop(m_brief.get());
+        else if (f == m_process.get())
+            loop(m_process.get());
+        else if (f == m_tag.get())
+            loop(m_tag.get());
+        else
+            loop(static_cast<Format*>(nullptr));
+    }
+
+private:
+    static const int DETECT_LINES = 16;
+
+    Formats& operator=(const Formats&) = delete;
+
+    array<Format*, 6> all() const {
+        return { m_threadTime.get(), m_time.get(), m_brief.get(), m_process.get(), m_tag.get(), m_long.get() };
+    }
+
+    Format* parse(string_view line, Format* first, Format* second = nullptr) {
+        bool hasSeparator = scan::hasSeparator(line.data(), line.data() + line.size());
+        first->parse(line, hasSeparator);
+        if (first->valid())
+            return first;
+        if (!second)
+            return nullptr;
+        second->parse(line, hasSeparator);
+        return second->valid() ? second : nullptr;
+    }
+
+    unique_ptr<ThreadTime> m_threadTime;
+    unique_ptr<Time> m_time;
+    unique_ptr<Brief> m_brief;
+    unique_ptr<Process> m_process;
+    unique_ptr<Tag> m_tag;
+    unique_ptr<Long> m_long;
+};
+
+/*
+ Grep-like context around the selected lines: those accepted by the filter
+ and, when a spotlight is set, holding one of its matches. Up to before
+ unselected lines are kept in a ring, as copies of their parsed records,
+ and are only rendered if a selected line follows; the after lines
+ following a selected one are printed as they come. Groups of lines which
+ are not adjacent are separated by "--". Being stateful, it needs lines to
+ come in order from a single thread.
+*/
+class Context
+{
+public:
+    Context(size_t before, size_t after, shared_ptr<const Filter> filter, shared_ptr<const Spotlight> spotlight) :
+        m_ring(before),
+        m_first(0),
+        m_count(0),
+        m_after(after),
+        m_pending(0),
+        m_printed(false),
+        m_skipped(false),
+        m_filter(filter),
+        m_spotlight(spotlight) {}
+
+    void add(Formats& formats, const Logcat& record, Output& out) {
+        if (selects(record)) {
+            printBefore(formats, out);
+            formats.print(out, record);
+            m_pending = m_after;
+        }
+        else if (m_pending) {
+            formats.print(out, record);
+            m_pending--;
+        }
+        else if (Entry* entry = push()) {
+            static string_view Logcat::* const fields[] = {
+                &Logcat::date, &Logcat::level, &Logcat::tag,
+                &Logcat::process, &Logcat::thread, &Logcat::message
+            };
+            entry->parsed = true;
+            entry->storage.clear();
+            for (string_view Logcat::* field : fields)
+                entry->storage.append(record.*field);
+            string_view storage = entry->storage;
+            for (string_view Logcat::* field : fields) {
+                entry->record.*field = storage.substr(0, (record.*field).size());
+                storage.remove_prefix((record.*field).size());
+            }
+        }
+    }
+
+    // A line in no known format, which is never selected.
+    void addUnparsed(string_view line, Output& out) {
+        if (m_pending) {
+            Format::printRaw(out, line);
+            m_pending--;
+        }
+        else if (Entry* entry = push()) {
+            entry->parsed = false;
+            entry->storage.assign(line.data(), line.size());
+        }
+    }
+
+private:
+    struct Entry {
+        string storage;
+        Logcat record;
+        bool parsed;
+    };
+
+    bool selects(const Logcat& l) const {
+        if (m_filter && !m_filter->accept(l))
+            return false;
+        return !m_spotlight ||
+                m_spotlight->search(l.date) || m_spotlight->search(l.process) ||
+                m_spotlight->search(l.thread) || m_spotlight->search(l.tag) ||
+                m_spotlight->search(l.message);
+    }
+
+    // Slot for a new unselected line, dropping the oldest one if needed.
+    Entry* push() {
+        if (m_ring.empty()) {
+            m_skipped = true;
+            return nullptr;
+        }
+        if (m_count == m_ring.size()) {
+            m_first = (m_first + 1) % m_ring.size();
+            m_count--;
+            m_skipped = true;
+        }
+        return &m_ring[(m_first + m_count++) % m_ring.size()];
+    }
+
+    void printBefore(Formats& formats, Output& out) {
+        if (m_printed && m_skipped && Format::output != Format::OUTPUT_JSON) {
+            out << "--";
+            out.endLine();
+        }
+        for (; m_count; m_count--, m_first = (m_first + 1) % m_ring.size()) {
+            const Entry& entry = m_ring[m_first];
+            if (entry.parsed)
+                formats.print(out, entry.record);
+            else
+                Format::printRaw(out, entry.storage);
+        }
+        m_printed = true;
+        m_skipped = false;
+    }
+
+    vector<Entry> m_ring;
+    size_t m_first;
+    size_t m_count;
+    size_t m_after;
+    size_t m_pending;
+    bool m_printed;
+    bool m_skipped;
+    shared_ptr<const Filter> m_filter;
+    shared_ptr<const Spotlight> m_spotlight;
+};
+
+/*
+ Collapses repeated records for --collapse, as Android's chatty does. A
+ record whose level, tag and message are those of one of the last WINDOW
+ distinct records printed is only counted, without being rendered. Once that
+ record leaves the window, or at the end of the input, a single line tells
+ how many times it was repeated. The window is a fixed ring of hashes, so
+ memory stays bounded. Being stateful, it needs lines to come in order from
+ a single thread.
+*/
+class Collapse
+{
+public:
+    static const size_t MAX_WINDOW = 256;
+
+    Collapse(size_t window) : m_hashes(window, 0), m_entries(window), m_next(0) {}
+
+    // Whether the record is not a repeat and must be printed. A record
+    // pushed out of the window gets its summary printed first.
+    bool add(Formats& formats, const Logcat& record, Output& out) {
+        // Candidates are compared in full, so the hash only needs to tell
+        // most records apart: it skips the middle of long messages.
+        uint64_t hash = 14695981039346656037ULL;
+        for (string_view field : { record.level, record.tag })
+            for (unsigned char c : field)
+                hash = (hash ^ c)*1099511628211ULL;
+        string_view message = record.message;
+        uint64_t head = 0, tail = 0;
+        if (!message.empty())
+            memcpy(&head, message.data(), min<size_t>(8, message.size()));
+        if (message.size() > 8)
+            memcpy(&tail, message.data() + message.size() - 8, 8);
+        for (uint64_t word : { static_cast<uint64_t>(message.size()), head, tail })
+            hash = (hash ^ word)*1099511628211ULL;
+
+        for (size_t i = 0; i < m_hashes.size(); i++) {
+            Entry& entry = m_entries[i];
+            if (m_hashes[i] != hash || !entry.used || entry.level != record.level ||
+                    entry.tag != record.tag || entry.message != record.message)
+                continue;
+            entry.repeats++;
+            entry.date.assign(record.date.data(), record.date.size());
+            entry.process.assign(record.process.data(), record.process.size());
+            entry.thread.assign(record.thread.data(), record.thread.size());
+            return false;
+        }
+
+        Entry& entry = m_entries[m_next];
+        summarize(formats, entry, out);
+        m_hashes[m_next] = hash;
+        entry.used = true;
+        entry.repeats = 0;
+        entry.level.assign(record.level.data(), record.level.size());
+        entry.tag.assign(record.tag.data(), record.tag.size());
+        entry.message.assign(record.message.data(), record.message.size());
+        m_next = (m_next + 1) % m_entries.size();
+        return true;
+    }
+
+    // Prints the summaries still pending, oldest first.
+    void finish(Formats& formats, Output& out) {
+        for (size_t i = 0; i < m_entries.size(); i++)
+            summarize(formats, m_entries[(m_next + i) % m_entries.size()], out);
+    }
+
+private:
+    struct Entry {
+        Entry() : used(false), repeats(0) {}
+        bool used;
+        size_t repeats;
+        string level;
+        string tag;
+        string message;
+        // Of the last repeat.
+        string date;
+        string process;
+        string thread;
+    };
+
+    void summarize(Formats& formats, Entry& entry, Output& out) {
+        if (entry.used && entry.repeats && Format::output == Format::OUTPUT_JSON) {
+            Format::printJson<Format::ANY_FIELDS>(
+                    out, Logcat { entry.date, entry.level, entry.tag, entry.process, entry.message, entry.thread },
+                    entry.repeats);
+        }
+        else if (entry.used && entry.repeats) {
+            string message = "repeated " + to_string(entry.repeats) + (entry.repeats == 1 ? " time: " : " times: ") +
+                             entry.message;
+            formats.print(out, Logcat { entry.date, entry.level, entry.tag, entry.process, message, entry.thread });
+        }
+        entry.used = false;
+    }
+
+    vector<uint64_t> m_hashes;
+    vector<Entry> m_entries;
+    size_t m_next;
+};
+
+/*
+ Per-tag rate limits for --rate-limit, so that a flooding tag can drown
+ neither the other tags nor the terminal. Every tag has a token bucket
+ holding one second's worth of lines, kept as the theoretical arrival time
+ of the GCRA: a line passes unless the bucket is ahead of the clock by more
+ than its burst, so that it costs a lookup and a comparison. Dropped lines
+ are counted per tag and reported inline, at most once per REPORT_INTERVAL.
+ Being stateful, it needs lines to come in order from a single thread.
+*/
+class RateLimiter
+{
+public:
+    static const size_t MAX_TAGS = 64*1024;
+    static const int64_t REPORT_INTERVAL = 1000000000;
+    static const size_t REPORT_TAGS = 5;
+    static const string OTHER_TAGS;
+
+    RateLimiter() : m_last(nullptr), m_nextReport(0), m_dropped(0) {}
+
+    // Adds a limit given as TAG=N/s, or as N/s for the tags without one.
+    void add(const string& spec) {
+        size_t equal = spec.rfind('=');
+        string tag = equal == string::npos ? string() : boost::trim_copy(spec.substr(0, equal));
+        string rate = boost::trim_copy(spec.substr(equal == string::npos ? 0 : equal + 1));
+        if (boost::ends_with(rate, "/s"))
+            rate.resize(rate.size() - 2);
+        char* end = nullptr;
+        long lines = strtol(rate.c_str(), &end, 10);
+        if (rate.empty() || *end || lines < 1 || (equal != string::npos && tag.empty()))
+            throw runtime_error("--rate-limit expects TAG=N/s or N/s with N at least 1, not '" + spec + "'");
+        Limit limit;
+        limit.interval = 1000000000LL/lines;
+        limit.burst = limit.interval*(lines - 1);
+        if (equal == string::npos)
+            m_default = limit;
+        else
+            m_limits[tag] = limit;
+    }
+
+    // Whether a line of the tag may be printed. Drops due for a report are
+    // reported first.
+    bool accept(string_view tag, Output& out) {
+        int64_t now = clock();
+        if (m_dropped && now >= m_nextReport)
+            report(out);
+
+        // Floods come as runs of the same tag.
+        if (!m_last || tag != m_tag) {
+            m_tag.assign(tag.data(), tag.size());
+            auto it = m_buckets.find(m_tag);
+            if (it == m_buckets.end()) {
+                if (m_buckets.size() < MAX_TAGS)
+                    it = m_buckets.emplace(m_tag, Bucket(limit(m_tag))).first;
+                else
+                    it = m_buckets.emplace(OTHER_TAGS, Bucket(m_default ? &*m_default : nullptr)).first;
+            }
+            m_last = &*it;
+        }
+        Bucket& bucket = m_last->second;
+        if (!bucket.limit)
+            return true;
+
+        int64_t arrival = max(bucket.arrival, now);
+        if (arrival - now > bucket.limit->burst) {
+            if (!bucket.dropped++)
+                m_pending.push_back(m_last);
+            if (!m_dropped++)
+                m_nextReport = now + REPORT_INTERVAL;
+            return false;
+        }
+        bucket.arrival = arrival + bucket.limit->interval;
+        return true;
+    }
+
+    // Reports the drops not reported yet.
+    void finish(Output& out) {
+        if (m_dropped)
+            report(out);
+    }
+
+private:
+    struct Limit {
+        int64_t interval;
+        int64_t burst;
+    };
+
+    struct Bucket {
+        Bucket(const Limit* limit) : limit(limit), arrival(0), dropped(0) {}
+        const Limit* limit;
+        int64_t arrival;
+        uint64_t dropped;
+    };
+
+    const Limit* limit(const string& tag) const {
+        auto it = m_limits.find(tag);
+        if (it != m_limits.end())
+            return &it->second;
+        return m_default ? &*m_default : nullptr;
+    }
+
+    // One line: the total, then the tags which dropped the most.
+    void report(Output& out) {
+        vector<pair<uint64_t, string>> tags;
+        for (pair<const string, Bucket>* tag : m_pending) {
+            tags.emplace_back(tag->second.dropped, tag->first == OTHER_TAGS ? "(other tags)" : tag->first);
+            tag->second.dropped = 0;
+        }
+        size_t count = min(REPORT_TAGS, tags.size());
+        partial_sort(tags.begin(), tags.begin() + count, tags.end(),
+                     [](const pair<uint64_t, string>& a, const pair<uint64_t, string>& b) {
+                         return a.first > b.first;
+                     });
+        if (Format::output == Format::OUTPUT_JSON) {
+            out << "{\"dropped\":" << to_string(m_dropped) << ",\"tags\":{";
+            for (size_t i = 0; i < tags.size(); i++) {
+                out << (i ? "," : "");
+                json::quote(out, tags[i].second);
+                out << ":" << to_string(tags[i].first);
+            }
+            out << "}}";
+        }
+        else {
+            out << AnsiSequence(Attribute::bold, Color::bdefault, Color::fyellow)
+                << "rate limit: dropped " << to_string(m_dropped) << (m_dropped == 1 ? " line (" : " lines (");
+            for (size_t i = 0; i < count; i++)
+                out << (i ? ", " : "") << tags[i].second << " " << to_string(tags[i].first);
+            if (tags.size() > count)
+                out << ", " << to_string(tags.size() - count) << " more tags";
+            out << ")" << AnsiSequenceReset();
+        }
+        out.endLine();
+        m_pending.clear();
+        m_dropped = 0;
+    }
+
+    // A tick of the coarse clock is short enough for a second's burst.
+    static int64_t clock() {
+        struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+        return ts.tv_sec*1000000000LL + ts.tv_nsec;
+    }
+
+    unordered_map<string, Limit> m_limits;
+    boost::optional<Limit> m_default;
+    // Tags beyond MAX_TAGS share the bucket of OTHER_TAGS, a NUL which no
+    // tag holds.
+    unordered_map<string, Bucket> m_buckets;
+    vector<pair<const string, Bucket>*> m_pending;
+    pair<const string, Bucket>* m_last;
+    string m_tag;
+    int64_t m_nextReport;
+    uint64_t m_dropped;
+};
+
+const string RateLimiter::OTHER_TAGS(1, '\0');
+
+/*
+ Selection of the lines dated between --since and --until, each given as a
+ prefix of MM-DD HH:MM:SS.mmm cut at a field boundary. As dates have no
+ year, they are ordered from the first one of the input, so that a capture
+ may span new year. Lines without a date follow the last dated one. The
+ range is only considered passed once dates go beyond --until by more than
+ REORDER_WINDOW, which tolerates lines slightly out of order.
+*/
+class TimeRange
+{
+public:
+    static const int64_t REORDER_WINDOW = 5000;
+
+    TimeRange(const string& since, const string& until) :
+        m_since(since.empty() ? -1 : key(complete(since, "00-00 00:00:00.000", "--since"))),
+        m_until(until.empty() ? -1 : key(complete(until, "99-99 23:59:59.999", "--until"))),
+        m_base(-1),
+        m_inside(since.empty()),
+        m_passed(false) {}
+
+    // Whether a line with this date, possibly empty, is selected.
+    bool follow(string_view date) {
+        if (date.size() != scan::DATE_LENGTH || !scan::isDate(date.data(), date.data() + date.size()))
+            return m_inside;
+        int64_t k = unwrap(date);
+        m_inside = (m_since < 0 || k >= unwrap(m_since)) && (m_until < 0 || k <= unwrap(m_until));
+        if (m_until >= 0 && k > unwrap(m_until) + REORDER_WINDOW)
+            m_passed = true;
+        return m_inside;
+    }
+
+    // Whether no more lines can be selected.
+    bool passed() const { return m_passed; }
+
+    // Milliseconds from a fictional start of year, with 32 days months.
+    static int64_t key(string_view date) {
+        auto number = [&](size_t i, size_t size) {
+            int64_t value = 0;
+            for (size_t j = i; j < i + size; j++)
+                value = value*10 + (date[j] - '0');
+            return value;
+        };
+        int64_t days = number(0, 2)*32 + number(3, 2);
+        return (((days*24 + number(6, 2))*60 + number(9, 2))*60 + number(12, 2))*1000 + number(15, 3);
+    }
+
+    /*
+     Offset in data of the first line dated at most REORDER_WINDOW before
+     --since, found by binary search on the dates starting the lines.
+    */
+    size_t seek(string_view data) {
+        size_t first = nextDate(data, 0);
+        if (first == data.size() || m_since < 0)
+            return 0;
+        anchor(data.substr(first, scan::DATE_LENGTH));
+
+        const int64_t target = unwrap(m_since) - REORDER_WINDOW;
+        size_t lo = 0;
+        size_t hi = data.size();
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo)/2;
+            size_t p = nextDate(data, mid);
+            if (p == data.size() || unwrap(data.substr(p, scan::DATE_LENGTH)) >= target)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        return lineStart(data, lo);
+    }
+
+private:
+    static const int64_t YEAR = 13*32*24*3600*1000LL;
+
+    static string complete(const string& date, const string& rest, const string& option) {
+        static const char layout[] = "dd-dd dd:dd:dd.ddd";
+        bool valid = date.size() == 5 || date.size() == 8 || date.size() == 11 ||
+                     date.size() == 14 || date.size() == scan::DATE_LENGTH;
+        for (size_t i = 0; valid && i < date.size(); i++)
+            valid = layout[i] == 'd' ? scan::isDigit(date[i]) : layout[i] == date[i];
+        if (!valid)
+            throw runtime_error(option + " expects MM-DD[ HH[:MM[:SS[.mmm]]]], not '" + date + "'");
+        return date + rest.substr(date.size());
+    }
+
+    void anchor(string_view date) {
+        if (m_base < 0)
+            m_base = key(date);
+    }
+
+    // Dates long before the first one belong to the following year.
+    int64_t unwrap(int64_t k) const { return k + YEAR/2 < m_base ? k + YEAR : k; }
+    int64_t unwrap(string_view date) {
+        anchor(date);
+        return unwrap(key(date));
+    }
+
+    static size_t lineStart(string_view data, size_t offset) {
+        if (offset == 0 || offset >= data.size())
+            return min(offset, data.size());
+        size_t eol = data.find('\n', offset - 1);
+        return eol == string_view::npos ? data.size() : eol + 1;
+    }
+
+    // Offset of the first line starting at or after offset with a date.
+    static size_t nextDate(string_view data, size_t offset) {
+        for (size_t p = lineStart(data, offset); p < data.size(); p = lineStart(data, p + 1))
+            if (scan::isDate(data.data() + p, data.data() + data.size()))
+                return p;
+        return data.size();
+    }
+
+    const int64_t m_since;
+    const int64_t m_until;
+    int64_t m_base;
+    bool m_inside;
+    bool m_passed;
+};
+
+/*
+ Decides when the output of a live input is flushed, each time everything
+ read so far has been processed. While more input is waiting, output keeps
+ being coalesced, up to a maximum latency from the read of the oldest line
+ not shown yet.
+ Once the input is drained, output is flushed at once, unless input has
+ been coming in a burst: it then lingers a little for more of it, so that
+ a burst costs a few large reads and writes instead of one per line.
+*/
+class FlushScheduler
+{
+public:
+    static const int DEFAULT_MAX_LATENCY = 20;
+    static const int64_t LINGER = 1000000;
+    static const int64_t BURST_GAP = 10000000;
+
+    FlushScheduler(Input& input, Output& out, int maxLatency) :
+        m_input(input), m_out(out), m_maxLatency(maxLatency*1000000LL), m_pending(0), m_idle(0) {}
+
+    // Notes that input was just read, before processing it.
+    void received() {
+        if (!m_pending)
+            m_pending = clock();
+    }
+
+    // Called once everything read has been processed.
+    void idle() {
+        int64_t now = clock();
+        bool burst = now - m_idle < BURST_GAP;
+        m_idle = now;
+        if (m_out.data().empty()) {
+            m_pending = 0;
+            return;
+        }
+        if (!m_pending)
+            m_pending = now;
+        int64_t budget = m_pending + m_maxLatency - now;
+        if (budget > 0 && m_input.ready())
+            return;
+        if (budget > 0 && burst) {
+            struct timespec delay = { 0, static_cast<long>(min(LINGER, budget)) };
+            nanosleep(&delay, nullptr);
+            if (m_input.ready())
+                return;
+        }
+        m_out.flush();
+        m_pending = 0;
+    }
+
+private:
+    static int64_t clock() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec*1000000000LL + ts.tv_nsec;
+    }
+
+    Input& m_input;
+    Output& m_out;
+    const int64_t m_maxLatency;
+    int64_t m_pending;
+    int64_t m_idle;
+};
+
+/*
+ Settings from the command line which drive the processing of lines.
+*/
+struct Options {
+    Options() : ignore(false), lineBuffered(false), binary(false), specialize(true), jobs(1),
+        maxLatency(FlushScheduler::DEFAULT_MAX_LATENCY) {}
+    bool ignore;
+    bool lineBuffered;
+    bool binary;
+    bool specialize;
+    int jobs;
+    int maxLatency;
+    shared_ptr<const Filter> filter;
+    shared_ptr<Context> context;
+    shared_ptr<Collapse> collapse;
+    shared_ptr<RateLimiter> rateLimit;
+    shared_ptr<TimeRange> range;
+};
+
+/*
+ Handles a parsed record, rendered as a record of the format F, or of any
+ format for Format itself.
+*/
+template<class F = Format>
+void processRecord(Formats& formats, const Options& options, const Logcat& record, Output& out)
+{
+    if (Stats::enabled)
+        Stats::record(record.level, record.tag);
+    Stats::Timer timer(Stats::RENDER);
+    if (options.range && !options.range->follow(record.date))
+        return;
+    if (options.context)
+        options.context->add(formats, record, out);
+    else if ((!options.filter || options.filter->accept(record)) &&
+             (!options.collapse || options.collapse->add(formats, record, out)) &&
+             (!options.rateLimit || options.rateLimit->accept(record.tag, out)))
+        formats.render<F::FIELDS>(out, record);
+}
+
+void processLine(Formats& formats, const Options& options, string_view line, Output& out)
+{
+    Format* f;
+    {
+        Stats::Timer timer(Stats::PARSE);
+        f = formats.parse(line);
+    }
+    if (Stats::enabled)
+        Stats::line(line.size(), f != nullptr);
+    if (f) {
+        if (f->hasRecord())
+            processRecord(formats, options, f->record(), out);
+        return;
+    }
+
+    // not in any known format: print it as is
+    if (options.ignore || (options.range && !options.range->follow(string_view())))
+        return;
+    if (options.context)
+        options.context->addUnparsed(line, out);
+    else
+        Format::printRaw(out, line);
+}
+
+/*
+ Same as processLine(), specialized for lines expected in the format F:
+ those are parsed and rendered without any virtual call, the others take
+ the general path. F is Format when there is no such format.
+*/
+template<class F>
+void processLine(Formats& formats, const Options& options, F* format, string_view line, Output& out)
+{
+    F* f = nullptr;
+    if constexpr (!is_same<F, Format>::value) {
+        Stats::Timer timer(Stats::PARSE);
+        f = formats.scanAs(format, line);
+    }
+    if (!f) {
+        processLine(formats, options, line, out);
+        return;
+    }
+    if (Stats::enabled)
+        Stats::line(line.size(), true);
+    processRecord<F>(formats, options, f->record(), out);
+}
+
+/*
+ Decoder for the output of adb logcat -B: a stream of logger_entry structures
+ (versions 1 to 4, little endian) each followed by a priority byte, a NUL
+ terminated tag and the message. Records are built straight from the binary
+ fields, without any text parsing. The binary entries of the events, stats
+ and security buffers are skipped from version 3 on, written by logd since
+ Android 5: version 2, of the kernel logger before it, has the same header
+ size but does not tell the buffer.
+*/
+class BinaryDecoder
+{
+public:
+    BinaryDecoder() : m_second(-1) {}
+
+    /*
+     Decodes the complete entries at the start of data and calls
+     handle(record) for every line of their messages. Returns the number of
+     bytes consumed; a partial entry at the end is left for the next call.
+    */
+    template<typename Handler>
+    size_t decode(string_view data, Handler handle) {
+        const unsigned char* begin = reinterpret_cast<const unsigned char*>(data.data());
+        size_t pos = 0;
+        while (data.size() - pos >= 4) {
+            const unsigned char* entry = begin + pos;
+            size_t payloadSize = read16(entry);
+            size_t headerSize = read16(entry + 2);
+            // Version 1 has padding instead of the header size.
+            if (headerSize == 0)
+                headerSize = HEADER_V1;
+            if (headerSize < HEADER_V1 || headerSize > HEADER_MAX)
+                throw runtime_error("invalid binary log entry");
+            if (data.size() - pos < headerSize + payloadSize)
+                break;
+            pos += headerSize + payloadSize;
+
+            // Versions 3 and 4 tell the buffer: events, stats and security
+            // hold binary payloads which are not text. Version 2 has the
+            // header size of version 3, with the euid of the writer where
+            // the buffer is, so it is read as one too. Android uids being 0
+            // or from 1000 on, none is taken for a binary buffer.
+            if (headerSize >= HEADER_V3) {
+                uint32_t id = read32(entry + 20);
+                if (id == LOG_ID_EVENTS || id == LOG_ID_STATS || id == LOG_ID_SECURITY)
+                    continue;
+            }
+            if (!payloadSize)
+                continue;
+
+            const char* payload = reinterpret_cast<const char*>(entry + headerSize);
+            const char* end = payload + payloadSize;
+            const char* tag = payload + 1;
+            const char* tagEnd = static_cast<const char*>(memchr(tag, '\0', end - tag));
+            if (!tagEnd)
+                tagEnd = end;
+            const char* message = tagEnd == end ? end : tagEnd + 1;
+            const char* messageEnd = static_cast<const char*>(memchr(message, '\0', end - message));
+            if (!messageEnd)
+                messageEnd = end;
+            while (messageEnd != message && messageEnd[-1] == '\n')
+                messageEnd--;
+
+            Logcat record;
+            record.date = formatDate(static_cast<int32_t>(read32(entry + 12)), read32(entry + 16));
+            record.level = level(static_cast<unsigned char>(payload[0]));
+            record.process = formatNumber(m_pid, read32(entry + 4));
+            record.thread = formatNumber(m_tid, read32(entry + 8));
+            record.tag = scan::slice(tag, tagEnd);
+
+            // As logcat does, every line of the message gets the header.
+            do {
+                const char* eol = static_cast<const char*>(memchr(message, '\n', messageEnd - message));
+                if (!eol)
+                    eol = messageEnd;
+                record.message = scan::slice(message, eol);
+                handle(record);
+                message = eol + 1;
+            } while (message < messageEnd);
+        }
+        return pos;
+    }
+
+private:
+    static const size_t HEADER_V1 = 20;
+    static const size_t HEADER_V3 = 24;
+    static const size_t HEADER_MAX = 128;
+    static const uint32_t LOG_ID_EVENTS = 2;
+    static const uint32_t LOG_ID_STATS = 5;
+    static const uint32_t LOG_ID_SECURITY = 6;
+
+    static uint16_t read16(const unsigned char* p) {
+        return p[0] | p[1] << 8;
+    }
+    static uint32_t read32(const unsigned char* p) {
+        return p[0] | p[1] << 8 | p[2] << 16 | static_cast<uint32_t>(p[3]) << 24;
+    }
+
+    static string_view level(unsigned char priority) {
+        static const char levels[] = "??VDIWEFS";
+        if (priority >= sizeof(levels) - 1)
+            priority = 0;
+        return string_view(levels + priority, 1);
+    }
+
+    static string_view formatNumber(char (&buffer)[16], uint32_t value) {
+        int size = snprintf(buffer, sizeof(buffer), "%u", value);
+        return string_view(buffer, size);
+    }
+
+    // MM-DD HH:MM:SS.mmm in local time, as logcat prints it.
+    string_view formatDate(int32_t second, uint32_t nanosecond) {
+        if (second != m_second) {
+            time_t time = second;
+            struct tm local;
+            localtime_r(&time, &local);
+            strftime(m_date, sizeof(m_date), "%m-%d %H:%M:%S", &local);
+            m_second = second;
+        }
+        snprintf(m_date + 14, sizeof(m_date) - 14, ".%03u", nanosecond/1000000 % 1000);
+        return string_view(m_date, scan::DATE_LENGTH);
+    }
+
+    int64_t m_second;
+    char m_date[32];
+    char m_pid[16];
+    char m_tid[16];
+};
+
+/*
+ Decodes a binary log, from a mapped file or from stdin as it arrives.
+*/
+void processBinary(Formats& formats, const Options& options, string_view data, Output& out)
+{
+    BinaryDecoder decoder;
+    size_t consumed = decoder.decode(data, [&](const Logcat& record) {
+        processRecord(formats, options, record, out);
+    });
+    if (consumed != data.size())
+        cerr << "Truncated binary log entry at the end of the input" << endl;
+}
+
+void processBinary(Formats& formats, const Options& options, Input& input, Output& out)
+{
+    const size_t CHUNK_SIZE = 64*1024;
+    BinaryDecoder decoder;
+    FlushScheduler scheduler(input, out, options.maxLatency);
+    string buffer;
+    while (true) {
+        size_t size = buffer.size();
+        buffer.resize(size + CHUNK_SIZE);
+        ssize_t count;
+        {
+            Stats::Timer timer(Stats::READ);
+            count = input.read(&buffer[size], CHUNK_SIZE);
+        }
+        if (count < 0) {
+            buffer.resize(size);
+            if (errno == EINTR)
+                continue;
+            throw runtime_error(string("cannot read input: ") + strerror(errno));
+        }
+        buffer.resize(size + count);
+        if (count == 0)
+            break;
+        scheduler.received();
+
+        size_t consumed = decoder.decode(buffer, [&](const Logcat& record) {
+            processRecord(formats, options, record, out);
+        });
+        buffer.erase(0, consumed);
+        scheduler.idle();
+        if (options.range && options.range->passed())
+            return;
+    }
+    if (!buffer.empty())
+        cerr << "Truncated binary log entry at the end of the input" << endl;
+}
+
+/*
+ Parses and renders batches of complete lines on a pool of workers. Batches
+ live in a ring of slots indexed by their sequence number: the reader fills
+ them in order, any worker renders them and a writer thread sends them to
+ the output in the same order.
+*/
+class Pipeline
+{
+public:
+    static const size_t BATCH_SIZE = 256*1024;
+
+    Pipeline(const Formats& formats, const Options& options, Output& out) :
+        m_options(options),
+        m_out(out),
+        m_slots(options.jobs*4),
+        m_submitted(0),
+        m_taken(0),
+        m_written(0),
+        m_closed(false),
+        m_failed(false) {
+        for (int i = 0; i < options.jobs; i++) {
+            m_formats.emplace_back(new Formats(formats));
+            m_workers.emplace_back(&Pipeline::work, this, m_formats.back().get());
+        }
+        m_writer = thread(&Pipeline::write, this);
+    }
+
+    ~Pipeline() {
+        try {
+            close();
+        }
+        catch (...) {}
+    }
+
+    // Hands over a buffer of complete lines. The buffer is swapped with a
+    // free one, which is returned cleared.
+    void submit(string& lines) {
+        unique_lock<mutex> lock(m_mutex);
+        Slot& slot = acquire(lock);
+        slot.buffer.swap(lines);
+        slot.input = slot.buffer;
+        release(lock);
+        lines.clear();
+    }
+
+    // Hands over complete lines which stay valid until close().
+    void submit(string_view lines) {
+        unique_lock<mutex> lock(m_mutex);
+        Slot& slot = acquire(lock);
+        slot.input = lines;
+        release(lock);
+    }
+
+    // Waits for all the batches to be written.
+    void close() {
+        {
+            lock_guard<mutex> lock(m_mutex);
+            if (m_closed)
+                return;
+            m_closed = true;
+        }
+        m_cond.notify_all();
+        for (thread& worker : m_workers)
+            worker.join();
+        m_writer.join();
+        if (m_failed)
+            rethrow_exception(m_error);
+    }
+
+private:
+    struct Slot {
+        enum State { FREE, FILLED, DONE };
+        Slot() : state(FREE) {}
+        State state;
+        string buffer;
+        string_view input;
+        Output output;
+    };
+
+    Slot& acquire(unique_lock<mutex>& lock) {
+        Slot& slot = m_slots[m_submitted % m_slots.size()];
+        m_cond.wait(lock, [&] { return slot.state == Slot::FREE || m_failed; });
+        if (m_failed)
+            rethrow_exception(m_error);
+        return slot;
+    }
+
+    void release(unique_lock<mutex>&) {
+        m_slots[m_submitted % m_slots.size()].state = Slot::FILLED;
+        m_submitted++;
+        m_cond.notify_all();
+    }
+
+    // Errors are handed over to the thread calling submit() or close().
+    void work(Formats* formats) {
+        unique_lock<mutex> lock(m_mutex);
+        try {
+            while (true) {
+                m_cond.wait(lock, [&] { return m_taken < m_submitted || m_closed || m_failed; });
+                if (m_failed || m_taken == m_submitted)
+                    return;
+                Slot& slot = m_slots[m_taken++ % m_slots.size()];
+                lock.unlock();
+
+                slot.output.clear();
+                formats->reset();
+                Format* detected = m_options.specialize ? formats->detect(slot.input) : nullptr;
+                formats->dispatch(detected, [&](auto* format) {
+                    LineReader lines(slot.input);
+                    string_view line;
+                    while (lines.next(line))
+                        processLine(*formats, m_options, format, line, slot.output);
+                });
+
+                lock.lock();
+                slot.state = Slot::DONE;
+                m_cond.notify_all();
+            }
+        }
+        catch (...) {
+            fail(lock);
+        }
+    }
+
+    // Records the current exception, unless an earlier one is, and stops
+    // every thread.
+    void fail(unique_lock<mutex>& lock) {
+        if (!lock.owns_lock())
+            lock.lock();
+        if (!m_failed)
+            m_error = current_exception();
+        m_failed = true;
+        m_cond.notify_all();
+    }
+
+    void write() {
+        unique_lock<mutex> lock(m_mutex);
+        try {
+            while (true) {
+                Slot& slot = m_slots[m_written % m_slots.size()];
+                if (slot.state != Slot::DONE) {
+                    // Nothing ready: show what we have.
+                    lock.unlock();
+                    m_out.flush();
+                    lock.lock();
+                }
+                m_cond.wait(lock, [&] {
+                    return slot.state == Slot::DONE || (m_closed && m_written == m_submitted) || m_failed;
+                });
+                if (m_failed || slot.state != Slot::DONE)
+                    return;
+                lock.unlock();
+
+                m_out.append(slot.output.data());
+                if (m_options.lineBuffered)
+                    m_out.flush();
+
+                lock.lock();
+                slot.state = Slot::FREE;
+                m_written++;
+                m_cond.notify_all();
+            }
+        }
+        catch (...) {
+            fail(lock);
+        }
+    }
+
+    const Options& m_options;
+    Output& m_out;
+    vector<unique_ptr<Formats>> m_formats;
+    vector<thread> m_workers;
+    thread m_writer;
+    vector<Slot> m_slots;
+    uint64_t m_submitted;
+    uint64_t m_taken;
+    uint64_t m_written;
+    bool m_closed;
+    bool m_failed;
+    exception_ptr m_error;
+    mutex m_mutex;
+    condition_variable m_cond;
+};
+
+/*
+ Reads an input in line-aligned batches rendered by a Pipeline.
+*/
+void processParallel(const Formats& formats, const Options& options, Input& input, Output& out)
+{
+    Pipeline pipeline(formats, options, out);
+    LineReader reader(input, Pipeline::BATCH_SIZE);
+    string batch;
+    string_view block;
+
+    while (reader.fill()) {
+        if (reader.nextBlock(block, Pipeline::BATCH_SIZE)) {
+            batch.assign(block.data(), block.size());
+            pipeline.submit(batch);
+        }
+    }
+
+    pipeline.close();
+}
+
+/*
+ The loop of processStream(), instantiated for the format F of the lines.
+ While F is Format, it looks for the format of the lines after each read
+ and continues with the loop for it once found.
+*/
+template<class F>
+void streamLines(Formats& formats, const Options& options, F* format, LineReader& reader,
+                 FlushScheduler& scheduler, Output& out)
+{
+    string_view line;
+    while (true) {
+        if constexpr (is_same<F, Format>::value) {
+            Format* detected = options.specialize ? formats.detect(reader.buffered()) : nullptr;
+            if (detected) {
+                formats.dispatch(detected, [&](auto* format) {
+                    streamLines(formats, options, format, reader, scheduler, out);
+                });
+                return;
+            }
+        }
+        while (reader.next(line)) {
+            processLine(formats, options, format, line, out);
+            if (options.range && options.range->passed())
+                return;
+        }
+        scheduler.idle();
+        if (!reader.fill())
+            return;
+        scheduler.received();
+    }
+}
+
+/*
+ Reads an input line by line, with output flushed as a FlushScheduler sees
+ fit. Reading stops once past a time range.
+*/
+void processStream(Formats& formats, const Options& options, Input& input, Output& out)
+{
+    LineReader reader(input);
+    FlushScheduler scheduler(input, out, options.maxLatency);
+    streamLines(formats, options, static_cast<Format*>(nullptr), reader, scheduler, out);
+}
+
+/*
+ Read-only mapping of a whole file.
+*/
+class MappedFile
+{
+public:
+    MappedFile(const string& path) : m_data(nullptr), m_size(0), m_modified() {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw runtime_error("cannot open " + path + ": " + strerror(errno));
+        try {
+            map(fd, path);
+        }
+        catch (...) {
+            ::close(fd);
+            throw;
+        }
+        ::close(fd);
+    }
+    // Maps a file already open, such as a redirected stdin.
+    MappedFile(int fd, const string& name) : m_data(nullptr), m_size(0), m_modified() {
+        map(fd, name);
+    }
+    ~MappedFile() {
+        if (m_data)
+            munmap(const_cast<char*>(m_data), m_size);
+    }
+
+    string_view data() const { return string_view(m_data, m_size); }
+    const timespec& modified() const { return m_modified; }
+
+    // For reads jumping around the file rather than going through it.
+    void adviseRandom() const {
+        if (m_data)
+            madvise(const_cast<char*>(m_data), m_size, MADV_RANDOM);
+    }
+
+private:
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    void map(int fd, const string& name) {
+        struct stat info;
+        if (fstat(fd, &info) < 0)
+            throw runtime_error("cannot stat " + name + ": " + strerror(errno));
+        if (!S_ISREG(info.st_mode))
+            throw runtime_error("cannot map " + name + ": not a regular file");
+        m_size = info.st_size;
+#ifdef __APPLE__
+        m_modified = info.st_mtimespec;
+#else
+        m_modified = info.st_mtim;
+#endif
+        if (m_size) {
+            void* data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED)
+                throw runtime_error("cannot map " + name + ": " + strerror(errno));
+            m_data = static_cast<const char*>(data);
+            madvise(data, m_size, MADV_SEQUENTIAL);
+        }
     }
 
+    const char* m_data;
+    size_t m_size;
+    timespec m_modified;
+};
+
+/*
+ Sidecar index of a saved log, written as PATH.idx by --index. It holds the
+ offset, date, level and interned tag of every line, so that a filter can
+ rule lines out without reading the log. Lines are grouped under sparse
+ checkpoints holding absolute offsets and dates, relative to which the per
+ line values fit in 32 bits. The size and modification time of the log, to
+ the nanosecond as a log may be rewritten within a second, are recorded and
+ the index is ignored once they change.
+*/
+class Index
+{
 public:
-    void setSpotlight(const string& spotlight) {
-        this->spotlight_pattern = (boost::format("(%1%)") % spotlight).str();
-    }
+    static const size_t CHECKPOINT_LINES = 4096;
 
-    const int type = -1;
-    Format(const string& pattern) {
-        this->l = Logcat { /*date   */ "",
-                           /*level  */ "",
-                           /*tag    */ "",
-                           /*process*/ "",
-                           /*message*/ "",
-                           /*thread */ "" };
-        this->pattern = pattern;
-        this->escapeSequencePattern = "\\^\\[(\\d+);(\\d+);(\\d+)m$";
+    static string path(const string& log) { return log + ".idx"; }
 
-        RESET = AnsiSequenceReset();
+    static void build(Formats& formats, const MappedFile& log, const string& path) {
+        const string temporary = path + ".tmp";
+        int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            throw runtime_error("cannot create " + temporary + ": " + strerror(errno));
 
-        stringstream ss;
-        ss << AnsiSequence(Attribute::reset, Color::bred, Color::fwhite)
-           << "$1"
-           << RESET;
-        this->spotlight_color = ss.str();
+        Header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, MAGIC, sizeof(header.magic));
+        header.size = log.data().size();
+        header.modifiedSeconds = log.modified().tv_sec;
+        header.modifiedNanoseconds = log.modified().tv_nsec;
 
-        // Parse configuration.
-        parseConfiguration();
-    }
+        vector<Checkpoint> checkpoints;
+        unordered_map<string, uint32_t> tagIds;
+        string tags;
+        string tag;
+        try {
+            Output out(fd);
+            out.append(reinterpret_cast<const char*>(&header), sizeof(header));
 
-    virtual ~Format() {};
-    static const int BRIEF;
-    static const int PROCESS;
-    static const int TAG;
-    static const int RAW;
-    static const int TIME;
-    static const int THREADTIME;
-    static const int LONG;
+            string_view data = log.data();
+            LineReader reader(data);
+            string_view text;
+            while (reader.next(text)) {
+                uint64_t offset = text.data() - data.data();
+                Line line;
+                line.date = UNKNOWN_DATE;
+                line.tagLevel = 0;
+                int64_t date = NO_BASE;
 
-    static AnsiSequence ID_VERBOSE;
-    static AnsiSequence ID_DEBUG;
-    static AnsiSequence ID_INFO;
-    static AnsiSequence ID_WARNING;
-    static AnsiSequence ID_ERROR;
-    static AnsiSequence ID_FATAL;
-    static AnsiSequence MSG_VERBOSE;
-    static AnsiSequence MSG_DEBUG;
-    static AnsiSequence MSG_INFO;
-    static AnsiSequence MSG_WARNING;
-    static AnsiSequence MSG_ERROR;
-    static AnsiSequence MSG_FATAL;
-    static AnsiSequence TID_PID;
-    static AnsiSequence RESET;
-    
-    virtual void parse(const string raw) = 0;
-    virtual bool valid() { return false; }
+                // Lines of -v long entries depend on their header and are
+                // always read.
+                const Format* f = formats.parse(text);
+                if (!f)
+                    line.date = NO_DATE;
+                else if (!dynamic_cast<const Long*>(f)) {
+                    const Logcat& l = f->record();
+                    if (l.date.empty())
+                        line.date = NO_DATE;
+                    else if (scan::isDate(l.date.data(), l.date.data() + l.date.size()) &&
+                             l.date.size() == scan::DATE_LENGTH)
+                        date = encodeDate(l.date);
+                    if (l.level.size() == 1 && l.level[0]) {
+                        tag.assign(l.tag.data(), l.tag.size());
+                        auto it = tagIds.find(tag);
+                        if (it == tagIds.end()) {
+                            if (tagIds.size() == MAX_TAGS)
+                                throw runtime_error("too many tags to index");
+                            it = tagIds.emplace(tag, tagIds.size()).first;
+                            tags.append(tag).push_back('\0');
+                        }
+                        line.tagLevel = it->second << 8 | static_cast<unsigned char>(l.level[0]);
+                    }
+                    else
+                        line.date = UNKNOWN_DATE;
+                }
 
-    void print() {
-        stringstream out;
+                // Start a checkpoint when the values relative to the current
+                // one would not fit.
+                Checkpoint* checkpoint = checkpoints.empty() ? nullptr : &checkpoints.back();
+                if (!checkpoint || header.lines - checkpoint->line >= CHECKPOINT_LINES ||
+                        offset - checkpoint->offset > UINT32_MAX ||
+                        (date != NO_BASE && checkpoint->date != NO_BASE &&
+                         (date - checkpoint->date > INT32_MAX || date - checkpoint->date <= UNKNOWN_DATE))) {
+                    checkpoints.push_back(Checkpoint { header.lines, offset, NO_BASE });
+                    checkpoint = &checkpoints.back();
+                }
+                if (date != NO_BASE) {
+                    if (checkpoint->date == NO_BASE)
+                        checkpoint->date = date;
+                    line.date = static_cast<int32_t>(date - checkpoint->date);
+                }
+                line.offset = static_cast<uint32_t>(offset - checkpoint->offset);
+                out.append(reinterpret_cast<const char*>(&line), sizeof(line));
+                header.lines++;
+            }
 
-        // date
-        if (this->l.date != "") {
-            static AnsiSequence seq = AnsiSequence(Attribute::reset, Color::bdefault, Color::fpurple);
-            out << seq
-                << " " << spotIfNeeded(l.date, seq) << " " << RESET;
+            header.checkpoints = checkpoints.size();
+            header.tags = tags.size();
+            out.append(reinterpret_cast<const char*>(checkpoints.data()), checkpoints.size()*sizeof(Checkpoint));
+            out.append(tags);
+            out.flush();
+            if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+                throw runtime_error("cannot write " + temporary + ": " + strerror(errno));
         }
-        
-        // level
-        AnsiSequence* idSeq = nullptr;
-        AnsiSequence* msgSeq = nullptr;
-        if (l.level == "D") {
-            idSeq = &ID_DEBUG;
-            msgSeq = &MSG_DEBUG;
-        }
-        else if (l.level == "V") {
-            idSeq = &ID_VERBOSE;
-            msgSeq = &MSG_VERBOSE;
-        }
-        else if (l.level == "I") {
-            idSeq = &ID_INFO;
-            msgSeq = &MSG_INFO;
-        }
-        else if (l.level == "W") {
-            idSeq = &ID_WARNING;
-            msgSeq = &MSG_WARNING;
+        catch (...) {
+            ::close(fd);
+            unlink(temporary.c_str());
+            throw;
         }
-        else if (l.level == "E") {
-            idSeq = &ID_ERROR;
-            msgSeq = &MSG_ERROR;
-        }
-        else if (l.level == "F") {
-            idSeq = &ID_FATAL;
-            msgSeq = &MSG_FATAL;
+        if (::close(fd) < 0 || rename(temporary.c_str(), path.c_str()) < 0) {
+            int error = errno;
+            unlink(temporary.c_str());
+            throw runtime_error("cannot write " + path + ": " + strerror(error));
         }
+    }
 
-        if (this->l.level != "") {
-            if (idSeq)
-                out << *idSeq << " " << this->l.level << " " << RESET;
-            out << " ";
+    // Maps the index of log, unless it is missing or stale.
+    bool open(const string& path, const MappedFile& log) {
+        if (access(path.c_str(), F_OK) < 0)
+            return false;
+        m_file.reset(new MappedFile(path));
+        string_view data = m_file->data();
+        if (data.size() >= sizeof(m_header.magic) &&
+                memcmp(data.data(), MAGIC, VERSION_OFFSET) == 0 &&
+                memcmp(data.data(), MAGIC, sizeof(m_header.magic)) != 0) {
+            cerr << "Ignoring " << path << ", written by another version" << endl;
+            return false;
         }
-        
-        // process/thread
-        if (this->l.process != "") {
-            stringstream _out;
-            _out << "[" << this->l.process
-                 << (this->l.thread != "" ? "/" + this->l.thread : "")
-                 << "]";
-            out << TID_PID
-                << spotIfNeeded(_out.str(), TID_PID)
-                << RESET;
-        }
-        
-        // tag    
-        if (this->l.tag != "") {
-            static AnsiSequence seq = AnsiSequence(Attribute::reset, Color::bdefault, Color::fwhite);
-            out << seq
-                << " " << spotIfNeeded(l.tag, seq)
-                << RESET;
+        if (data.size() < sizeof(Header))
+            throw runtime_error("invalid index " + path);
+        memcpy(&m_header, data.data(), sizeof(Header));
+        if (memcmp(m_header.magic, MAGIC, sizeof(m_header.magic)) != 0 ||
+                data.size() != sizeof(Header) + m_header.lines*sizeof(Line) +
+                                m_header.checkpoints*sizeof(Checkpoint) + m_header.tags)
+            throw runtime_error("invalid index " + path);
+        if (m_header.size != log.data().size() ||
+                m_header.modifiedSeconds != log.modified().tv_sec ||
+                m_header.modifiedNanoseconds != log.modified().tv_nsec) {
+            cerr << "Ignoring " << path << ", which is older than the log" << endl;
+            return false;
         }
 
-        // message
-        if (this->l.message != "") {
-            out << " ";
-            if (idSeq)
-                out << *msgSeq;
-            out << spotIfNeeded(l.message, (msgSeq ? *msgSeq : RESET));
+        data.remove_prefix(sizeof(Header));
+        m_lines = reinterpret_cast<const Line*>(data.data());
+        data.remove_prefix(m_header.lines*sizeof(Line));
+        m_checkpoints.resize(m_header.checkpoints);
+        memcpy(m_checkpoints.data(), data.data(), m_header.checkpoints*sizeof(Checkpoint));
+        data.remove_prefix(m_header.checkpoints*sizeof(Checkpoint));
+        m_tags.clear();
+        while (!data.empty()) {
+            size_t end = data.find('\0');
+            if (end == string_view::npos)
+                throw runtime_error("invalid index " + path);
+            m_tags.push_back(data.substr(0, end));
+            data.remove_prefix(end + 1);
         }
+        return true;
+    }
+
+    /*
+     Calls handler(begin, end) for each run of lines of the log the filter
+     may accept. Lines in no known format are selected unless ignored.
+    */
+    template <class Handler>
+    void select(const Filter& filter, bool ignore, Handler handler) const {
+        Logcat l;
+        char date[scan::DATE_LENGTH];
+        char level;
+        uint64_t begin = 0;
+        bool selecting = false;
+        for (size_t c = 0; c < m_checkpoints.size(); c++) {
+            const Checkpoint& checkpoint = m_checkpoints[c];
+            uint64_t last = c + 1 < m_checkpoints.size() ? m_checkpoints[c + 1].line : m_header.lines;
+            for (uint64_t i = checkpoint.line; i < last; i++) {
+                const Line& line = m_lines[i];
+                bool selected;
+                if (line.date == UNKNOWN_DATE)
+                    selected = true;
+                else if (!(line.tagLevel & 0xff))
+                    selected = !ignore;
+                else {
+                    if ((line.tagLevel >> 8) >= m_tags.size())
+                        throw runtime_error("invalid index");
+                    level = static_cast<char>(line.tagLevel & 0xff);
+                    l.level = string_view(&level, 1);
+                    l.tag = m_tags[line.tagLevel >> 8];
+                    l.date = string_view();
+                    if (line.date != NO_DATE) {
+                        decodeDate(checkpoint.date + line.date, date);
+                        l.date = string_view(date, sizeof(date));
+                    }
+                    selected = filter.mayAccept(l);
+                }
 
-        out << RESET;
-        cout << out.str() << endl;
+                uint64_t offset = checkpoint.offset + line.offset;
+                if (selected && !selecting)
+                    begin = offset;
+                else if (!selected && selecting)
+                    handler(begin, offset);
+                selecting = selected;
+            }
+        }
+        if (selecting)
+            handler(begin, m_header.size);
     }
 
 private:
-    void parseConfiguration() {
+    // The magic ends with the version of the layout.
+    static constexpr const char* MAGIC = "LCIDX002";
+    static const size_t VERSION_OFFSET = 5;
+    static const uint32_t MAX_TAGS = 1 << 24;
+    static const int32_t NO_DATE = INT32_MIN;
+    static const int32_t UNKNOWN_DATE = INT32_MIN + 1;
+    static const int64_t NO_BASE = INT64_MIN;
 
-#define RESET_FORMAT(level) \
-    reset_format("LOGCAT_COLORIZE_" #level, level)
+    struct Header {
+        char magic[8];
+        uint64_t size;
+        int64_t modifiedSeconds;
+        int64_t modifiedNanoseconds;
+        uint64_t lines;
+        uint64_t checkpoints;
+        uint64_t tags;
+    };
 
-        RESET_FORMAT(ID_DEBUG);
-        RESET_FORMAT(ID_VERBOSE);
-        RESET_FORMAT(ID_INFO);
-        RESET_FORMAT(ID_WARNING);
-        RESET_FORMAT(ID_ERROR);
-        RESET_FORMAT(ID_FATAL);
-        RESET_FORMAT(MSG_DEBUG);
-        RESET_FORMAT(MSG_VERBOSE);
-        RESET_FORMAT(MSG_INFO);
-        RESET_FORMAT(MSG_WARNING);
-        RESET_FORMAT(MSG_ERROR);
-        RESET_FORMAT(MSG_FATAL);
-        RESET_FORMAT(TID_PID);
-    }
+    struct Checkpoint {
+        uint64_t line;
+        uint64_t offset;
+        int64_t date;
+    };
 
-    void reset_format(const string& envVarName, AnsiSequence& ansiSequence)
-    {
-        boost::optional<AnsiSequence> custom = parseEscapeSequenceVariable(envVarName);
-        if (custom)
-            ansiSequence = custom.get();
-    }
+    // The date is relative to the checkpoint; the level is 0 for lines in
+    // no known format.
+    struct Line {
+        uint32_t offset;
+        int32_t date;
+        uint32_t tagLevel;
+    };
 
-    boost::optional<AnsiSequence> parseEscapeSequenceVariable(const string& envVar) {
-        char* envValue = getenv(envVar.c_str());
-        if (!envValue)
-            return boost::none;
-        
-        const string escapeSequenceString(envValue);
-        string::const_iterator start;
-        start = escapeSequenceString.begin();
-        boost::smatch results;
-        boost::match_flag_type flags = boost::match_default;
-        boost::regex_search(start, escapeSequenceString.end(), results, this->escapeSequencePattern, flags);
-        if (results.size() >= 4) {
-            string attr = results[1];
-            string bg = results[2];
-            string fg = results[3];
-            return AnsiSequence(attr, bg, fg);
-        }
-        
-        return boost::none;
+    // MM-DD HH:MM:SS.mmm as the number made of its digits, which orders
+    // like the text.
+    static int64_t encodeDate(string_view date) {
+        int64_t value = 0;
+        for (char c : date)
+            if (scan::isDigit(c))
+                value = value*10 + (c - '0');
+        return value;
     }
 
-    string spotIfNeeded(const string& log, const AnsiSequence& resume) {
-        if (!spotlight_pattern.empty())
-            return boost::regex_replace(log, spotlight_pattern, spotlight_color + resume.str());
-        else
-            return log;
+    static void decodeDate(int64_t value, char* date) {
+        static const char layout[] = "dd-dd dd:dd:dd.ddd";
+        for (size_t i = scan::DATE_LENGTH; i--;) {
+            if (layout[i] == 'd') {
+                date[i] = '0' + value % 10;
+                value /= 10;
+            }
+            else
+                date[i] = layout[i];
+        }
     }
-};
 
-const int Format::BRIEF      = 0;
-const int Format::PROCESS    = 1;
-const int Format::TAG        = 2;
-const int Format::RAW        = 3;
-const int Format::TIME       = 4;
-const int Format::THREADTIME = 5;
-const int Format::LONG       = 6;
+    unique_ptr<MappedFile> m_file;
+    Header m_header;
+    const Line* m_lines;
+    vector<Checkpoint> m_checkpoints;
+    vector<string_view> m_tags;
+};
 
-AnsiSequence Format::ID_VERBOSE = AnsiSequence(Attribute::bold, Color::bcyan, Color::fwhite);
-AnsiSequence Format::ID_DEBUG   = AnsiSequence(Attribute::bold, Color::bblue, Color::fwhite);
-AnsiSequence Format::ID_INFO    = AnsiSequence(Attribute::bold, Color::bgreen, Color::fwhite);
-AnsiSequence Format::ID_WARNING = AnsiSequence(Attribute::bold, Color::byellow, Color::fwhite);
-AnsiSequence Format::ID_ERROR   = AnsiSequence(Attribute::bold, Color::bred, Color::fwhite);
-AnsiSequence Format::ID_FATAL   = ID_ERROR;
+/*
+ Processes a file in place from its mapping, handing newline-aligned chunks
+ to a Pipeline when more than one job is requested. A time range starts
+ where a binary search puts it and stops once passed. When filtering with
+ an up to date index, only the lines it cannot rule out are read.
+*/
+void processMapped(Formats& formats, const Options& options, const MappedFile& file,
+                   const string& indexPath, Output& out)
+{
+    string_view data = file.data();
+    if (options.range && !options.binary)
+        data.remove_prefix(options.range->seek(data));
 
-AnsiSequence Format::MSG_VERBOSE = AnsiSequence(Attribute::reset, Color::bdefault, Color::fcyan);
-AnsiSequence Format::MSG_DEBUG   = AnsiSequence(Attribute::reset, Color::bdefault, Color::fblue);
-AnsiSequence Format::MSG_INFO    = AnsiSequence(Attribute::reset, Color::bdefault, Color::fgreen);
-AnsiSequence Format::MSG_WARNING = AnsiSequence(Attribute::reset, Color::bdefault, Color::fyellow);
-AnsiSequence Format::MSG_ERROR   = AnsiSequence(Attribute::reset, Color::bdefault, Color::fred);
-AnsiSequence Format::MSG_FATAL   = MSG_ERROR;
+    if (options.binary) {
+        processBinary(formats, options, data, out);
+        return;
+    }
 
-AnsiSequence Format::TID_PID     = AnsiSequence(Attribute::reset, Color::bblack, Color::fcyan);
+    unique_ptr<Pipeline> pipeline;
+    if (options.jobs > 1)
+        pipeline.reset(new Pipeline(formats, options, out));
+    auto process = [&](string_view lines) {
+        LineReader reader(lines);
+        if (!pipeline) {
+            Format* detected = options.specialize ? formats.detect(lines) : nullptr;
+            formats.dispatch(detected, [&](auto* format) {
+                string_view line;
+                while (reader.next(line) && !(options.range && options.range->passed()))
+                    processLine(formats, options, format, line, out);
+            });
+            return;
+        }
+        string_view block;
+        while (reader.nextBlock(block, Pipeline::BATCH_SIZE))
+            pipeline->submit(block);
+    };
 
-AnsiSequence Format::RESET       = AnsiSequenceReset();
+    Index index;
+    if (options.filter && !options.context && !indexPath.empty() && index.open(indexPath, file)) {
+        file.adviseRandom();
+        const uint64_t start = file.data().size() - data.size();
+        index.select(*options.filter, options.ignore, [&](uint64_t begin, uint64_t end) {
+            if (end > start)
+                process(file.data().substr(max(begin, start), end - max(begin, start)));
+        });
+    }
+    else
+        process(data);
 
-class Tag : public Format {
+    if (pipeline)
+        pipeline->close();
+}
 
-public:
-    const int type = Format::TAG;
-    Tag() : Format("^([VDIWEF])/(.*?): (.*)$") {}
-    ~Tag() {}
-    virtual void parse(const string raw) {
-        boost::smatch matches = this->match(raw);
-        if (matches.size() >= 3) {
-            this->l.date = "";
-            this->l.level = matches[1];
-            this->l.message = matches[3];
-            this->l.process = "";
-            this->l.tag = matches[2];
-            this->l.thread = "";
-        }
+/*
+ Maps a regular file, or reads it as a stream when compressed or when not a
+ regular file, such as a FIFO. Streams cannot be searched for a time range
+ nor use an index.
+*/
+void processFile(Formats& formats, const Options& options, const string& path, Output& out)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw runtime_error("cannot open " + path + ": " + strerror(errno));
+    try {
+        Input input(fd);
+        struct stat info;
+        if (fstat(fd, &info) < 0)
+            throw runtime_error("cannot stat " + path + ": " + strerror(errno));
+        if (!input.detect(path) && S_ISREG(info.st_mode))
+            processMapped(formats, options, MappedFile(fd, path), Index::path(path), out);
+        else if (options.binary)
+            processBinary(formats, options, input, out);
+        else if (options.jobs > 1)
+            processParallel(formats, options, input, out);
+        else
+            processStream(formats, options, input, out);
     }
-    virtual bool valid() {
-        return this->l.level != "";
+    catch (...) {
+        ::close(fd);
+        throw;
     }
-};
-
-class Process : public Format {
+    ::close(fd);
+}
 
+/*
+ Merges several inputs, files or FIFOs, into one view ordered by date, each
+ line prefixed with the colored name of its input. Pipes are read as data
+ arrives, through epoll where available, regular files only when they have
+ nothing buffered. Every input keeps its own order; the next line is the
+ oldest of the lines at the front of the inputs, taken once every input
+ still open has one, or once it has waited for the reorder window. Lines
+ without a date take the one of the previous line of their input, so the
+ message lines of a -v long entry follow its header.
+*/
+class Merger
+{
 public:
-    const int type = Format::PROCESS;
-    Process() : Format("^([VDIWEF])\\(([ 0-9]{1,})\\) (.*) \\(((.*?))\\)$") {}
-    ~Process() {}
-    virtual void parse(const string raw) {
-        boost::smatch matches = this->match(raw);
-        if (matches.size() >= 4) {
-            this->l.date = "";
-            this->l.level = matches[1];
-            this->l.message = matches[3];
-            this->l.process = matches[2];
-            this->l.tag = matches[4];
-            this->l.thread = "";
+    static const int DEFAULT_WINDOW = 500;
+
+    Merger(const vector<string>& paths, int window) : m_window(window), m_seq(0), m_poll(-1) {
+        static const string colors[] = {
+            Color::fcyan, Color::fyellow, Color::fgreen, Color::fpurple, Color::fblue, Color::fred
+        };
+        size_t width = 0;
+        for (const string& path : paths)
+            width = max(width, path.substr(path.rfind('/') + 1).size());
+        for (size_t i = 0; i < paths.size(); i++) {
+            unique_ptr<Source> source(new Source);
+            source->index = i;
+            source->path = paths[i];
+            string label = paths[i].substr(paths[i].rfind('/') + 1);
+            if (Format::output == Format::OUTPUT_JSON) {
+                // Opens the object of every line, as a first member.
+                Output json;
+                json << "{\"source\":";
+                json::quote(json, label);
+                json << ",";
+                source->label = string(json.data());
+            }
+            else {
+                label.resize(width, ' ');
+                source->label = AnsiSequence(Attribute::bold, Color::bdefault, colors[i % 6]).str() +
+                                label + AnsiSequenceReset().str() + " ";
+            }
+            m_sources.push_back(move(source));
         }
     }
-    virtual bool valid() {
-        return this->l.level != "" && this->l.process != "";
+
+    ~Merger() {
+        for (const unique_ptr<Source>& source : m_sources)
+            if (source->fd >= 0)
+                ::close(source->fd);
+#ifdef __linux__
+        if (m_poll >= 0)
+            ::close(m_poll);
+#endif
     }
-};
 
+    void run(Formats& formats, const Options& options, Output& out) {
+        open();
+        // Lines of -v long entries are parsed in the context of their input.
+        for (const unique_ptr<Source>& source : m_sources)
+            source->formats.reset(new Formats(formats));
+        Output scratch;
+        while (true) {
+            // Regular files are read on demand.
+            for (const unique_ptr<Source>& source : m_sources)
+                if (!source->pipe && !source->eof && source->pending.empty())
+                    read(*source);
 
-class Brief : public Format {
+            // Emit what can be ordered.
+            size_t waiting = 0;
+            for (const unique_ptr<Source>& source : m_sources)
+                if (!source->eof && source->pending.empty())
+                    waiting++;
+            while (!m_heads.empty()) {
+                Head head = m_heads.top();
+                Source& source = *m_sources[head.source];
+                if (waiting && source.pending.front().arrival + m_window > now())
+                    break;
+                m_heads.pop();
 
-public:
-    const int type = Format::BRIEF;
-    Brief() : Format("^([VDIWEF])/(.*?)\\(([ 0-9]{1,})\\): (.*)$") {}
-    ~Brief() {}
-    virtual void parse(const string raw) {
-        boost::smatch matches = this->match(raw);
-        if (matches.size() >= 5) {
-            this->l.date = "";
-            this->l.level = matches[1];
-            this->l.message = matches[4];
-            this->l.process = matches[3];
-            this->l.tag = matches[2];
-            this->l.thread = "";
-        }
-    }
-    virtual bool valid() {
-        return this->l.level != "" && this->l.process != "";
-    }
-};
+                scratch.clear();
+                processLine(*source.formats, options, source.pending.front().text, scratch);
+                for (string_view lines = scratch.data(); !lines.empty();) {
+                    size_t eol = lines.find('\n');
+                    size_t open = Format::output == Format::OUTPUT_JSON ? 1 : 0;
+                    out << source.label << lines.substr(open, eol - open);
+                    out.endLine();
+                    lines.remove_prefix(eol + 1);
+                }
 
-class Time : public Format {
+                source.pending.pop_front();
+                if (!source.pending.empty())
+                    push(head.source);
+                else if (!source.eof) {
+                    waiting++;
+                    if (!source.pipe)
+                        break;
+                }
+            }
 
-public:
-    const int type = Format::TIME;
-    Time() : Format("^([0-9]{2}-[0-9]{2} [0-9]{2}:[0-9]{2}:[0-9]{2}.[0-9]{3}):? ([VDIWEF])/(.*?)\\(([ 0-9]{1,})\\)\\s*: (.*)$") {}
-    ~Time() {}
-    virtual void parse(string raw) {
-        boost::smatch matches = this->match(raw);
-        if (matches.size() >= 6) {
-            this->l.date = matches[1];
-            this->l.level = matches[2];
-            this->l.message = matches[5];
-            this->l.process = matches[4];
-            this->l.tag = matches[3];
-            this->l.thread = "";
+            bool open = false;
+            for (const unique_ptr<Source>& source : m_sources)
+                open = open || !source->eof;
+            if (!open && m_heads.empty())
+                break;
+            if (!waiting || !any_of(m_sources.begin(), m_sources.end(), [](const unique_ptr<Source>& s) {
+                    return s->pipe && !s->eof && s->pending.empty();
+                }))
+                continue;
+
+            // Wait for the pipes with nothing buffered, or until the oldest
+            // line is due.
+            out.flush();
+            int timeout = -1;
+            if (!m_heads.empty()) {
+                int64_t due = m_sources[m_heads.top().source]->pending.front().arrival + m_window;
+                timeout = static_cast<int>(max<int64_t>(0, due - now()));
+            }
+            wait(timeout);
         }
     }
-    virtual bool valid() {
-        return this->l.date != "" && this->l.level != "" && this->l.process != "";
-    }
-};
 
-class ThreadTime : public Format {
+private:
+    struct Line {
+        string text;
+        int64_t key;
+        int64_t arrival;
+        uint64_t seq;
+    };
 
-public:
-    const int type = Format::THREADTIME;
-    ThreadTime() : Format("^([0-9]{2}-[0-9]{2} [0-9]{2}:[0-9]{2}:[0-9]{2}.[0-9]{3})[[:space:]]*([0-9]{1,})[[:space:]]*([0-9]{1,}) ([VDIWEF]) (.*?): (.*)$") {}
-    ~ThreadTime() {}
-    virtual void parse(string raw) {
-        boost::smatch matches = this->match(raw);
-        if (matches.size() >= 7) {
-            this->l.date = matches[1];
-            this->l.level = matches[4];
-            this->l.message = matches[6];
-            this->l.process = matches[2];
-            this->l.tag = matches[5];
-            this->l.thread = matches[3];
+    struct Source {
+        Source() : index(0), fd(-1), pipe(false), eof(false), key(INT64_MIN) {}
+        size_t index;
+        string path;
+        string label;
+        int fd;
+        bool pipe;
+        bool eof;
+        int64_t key;
+        unique_ptr<Input> input;
+        unique_ptr<LineReader> reader;
+        unique_ptr<Formats> formats;
+        deque<Line> pending;
+    };
+
+    struct Head {
+        int64_t key;
+        uint64_t seq;
+        size_t source;
+        bool operator<(const Head& other) const {
+            return key != other.key ? key > other.key : seq > other.seq;
         }
+    };
+
+    static int64_t now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec*1000LL + ts.tv_nsec/1000000;
     }
-    virtual bool valid() {
-        return this->l.date != "" && this->l.level != "" && this->l.process != "" && this->l.thread != "";
-    }
-};
 
+    void open() {
+#ifdef __linux__
+        m_poll = epoll_create1(0);
+        if (m_poll < 0)
+            throw runtime_error(string("cannot create epoll: ") + strerror(errno));
+#endif
+        for (size_t i = 0; i < m_sources.size(); i++) {
+            Source& source = *m_sources[i];
+            // Blocks until a FIFO has a writer, so that it is not at its end yet.
+            source.fd = ::open(source.path.c_str(), O_RDONLY);
+            if (source.fd < 0)
+                throw runtime_error("cannot open " + source.path + ": " + strerror(errno));
+            struct stat info;
+            if (fstat(source.fd, &info) < 0)
+                throw runtime_error("cannot stat " + source.path + ": " + strerror(errno));
+            source.pipe = !S_ISREG(info.st_mode);
+            source.input.reset(new Input(source.fd));
+            source.reader.reset(new LineReader(*source.input));
+            if (!source.pipe) {
+                source.input->detect(source.path);
+                continue;
+            }
+            fcntl(source.fd, F_SETFL, fcntl(source.fd, F_GETFL) | O_NONBLOCK);
+#ifdef __linux__
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.u64 = i;
+            if (epoll_ctl(m_poll, EPOLL_CTL_ADD, source.fd, &event) < 0)
+                throw runtime_error("cannot poll " + source.path + ": " + strerror(errno));
+#endif
+        }
+    }
 
-Format* getFormat(const string raw) {
-    //
-    // At this point we don't know yet which format is being used, so guess it
-    // (from the more complex first)
-    //
-    std::unique_ptr<Format> out(new ThreadTime());
-    out->parse(raw);
-    if (!out->valid()) {
-        out.reset(new Time());
-        out->parse(raw);
-        if (!out->valid()) {
-            out.reset(new Brief());
-            out->parse(raw);
-            if (!out->valid()) {
-                out.reset(new Process());
-                out->parse(raw);
-                if (!out->valid()) {
-                    out.reset(new Tag());
-                    out->parse(raw);
-                    if (!out->valid()) {
-                        out = NULL;
-                    }
-                }
+    void wait(int timeout) {
+        vector<size_t> ready;
+#ifdef __linux__
+        struct epoll_event events[16];
+        int count = epoll_wait(m_poll, events, 16, timeout);
+        for (int i = 0; i < count; i++)
+            ready.push_back(events[i].data.u64);
+#else
+        vector<struct pollfd> fds;
+        vector<size_t> indexes;
+        for (size_t i = 0; i < m_sources.size(); i++) {
+            if (m_sources[i]->pipe && !m_sources[i]->eof) {
+                fds.push_back({ m_sources[i]->fd, POLLIN, 0 });
+                indexes.push_back(i);
             }
         }
+        int count = poll(fds.data(), fds.size(), timeout);
+        for (int i = 0; count > 0 && i < static_cast<int>(fds.size()); i++)
+            if (fds[i].revents)
+                ready.push_back(indexes[i]);
+#endif
+        if (count < 0 && errno != EINTR)
+            throw runtime_error(string("cannot poll inputs: ") + strerror(errno));
+        for (size_t i : ready)
+            read(*m_sources[i]);
     }
-    return out.release();
-}
+
+    // Queues the lines available from a source, without blocking on pipes.
+    void read(Source& source) {
+        bool wasEmpty = source.pending.empty();
+        if (!source.reader->fill()) {
+            source.eof = true;
+#ifdef __linux__
+            if (source.pipe)
+                epoll_ctl(m_poll, EPOLL_CTL_DEL, source.fd, nullptr);
+#endif
+        }
+        int64_t arrival = now();
+        string_view text;
+        while (source.reader->next(text)) {
+            // At the start of the line, or after the "[ " of a -v long header.
+            const char* end = text.data() + text.size();
+            if (scan::isDate(text.data(), end))
+                source.key = TimeRange::key(text.substr(0, scan::DATE_LENGTH));
+            else if (text.size() > 2 && text[0] == '[' && text[1] == ' ' && scan::isDate(text.data() + 2, end))
+                source.key = TimeRange::key(text.substr(2, scan::DATE_LENGTH));
+            source.pending.push_back(Line { string(text), source.key, arrival, m_seq++ });
+        }
+        if (wasEmpty && !source.pending.empty())
+            push(source.index);
+    }
+
+    void push(size_t i) {
+        const Line& line = m_sources[i]->pending.front();
+        m_heads.push(Head { line.key, line.seq, i });
+    }
+
+    const int m_window;
+    uint64_t m_seq;
+    int m_poll;
+    vector<unique_ptr<Source>> m_sources;
+    priority_queue<Head> m_heads;
+};
 
 void list_ansi()
 {
@@ -631,16 +4899,67 @@ void list_ansi()
 
 }
 
+int reportMismatches()
+{
+    if (!Format::mismatches && !Spotlight::mismatches)
+        return SUCCESS;
+    if (Format::mismatches)
+        cerr << Format::mismatches << " line(s) parsed differently by the scanner" << endl;
+    if (Spotlight::mismatches)
+        cerr << Spotlight::mismatches << " line(s) wrongly ruled out by the spotlight literals" << endl;
+    return ERROR_VERIFY;
+}
+
+// Reports on stderr what the run found, returning the exit status.
+int finish()
+{
+    if (Stats::enabled)
+        Stats::report(cerr);
+    return reportMismatches();
+}
+
+// Completes the output of a run before reporting.
+int finish(Formats& formats, const Options& options, Output& out)
+{
+    if (options.collapse)
+        options.collapse->finish(formats, out);
+    if (options.rateLimit)
+        options.rateLimit->finish(out);
+    out.flush();
+    return finish();
+}
+
 int main(int argc, char** argv) {
     try {
         // parse command line arguments, if available
-        bool ignore = false;
+        Options options;
         namespace po = boost::program_options;
         po::options_description desc("Options");
         desc.add_options()
           ("help,h", "")
-          ("spotlight,s",po::value<string>(), "")
+          ("spotlight,s",po::value<vector<string>>(), "")
           ("ignore,i", "")
+          ("tag-colors", "")
+          ("filter,F", po::value<string>(), "")
+          ("after,A", po::value<int>(), "")
+          ("before", po::value<int>(), "")
+          ("context,C", po::value<int>(), "")
+          ("collapse", po::value<int>()->implicit_value(1), "")
+          ("rate-limit", po::value<vector<string>>(), "")
+          ("file,f", po::value<vector<string>>(), "")
+          ("reorder-window", po::value<int>(), "")
+          ("since", po::value<string>(), "")
+          ("until", po::value<string>(), "")
+          ("index", "")
+          ("binary,B", "")
+          ("jobs,j", po::value<int>(), "")
+          ("line-buffered", "")
+          ("max-latency", po::value<int>(), "")
+          ("stats", "")
+          ("regex", "")
+          ("verify", "")
+          ("generic", "")
+          ("output,o", po::value<string>(), "")
           ("list-ansi", "");
 
         po::variables_map vm;
@@ -656,49 +4975,146 @@ int main(int argc, char** argv) {
             return SUCCESS;
         }
 
-        if (vm.count("ignore")) ignore = true;
+        if (vm.count("ignore")) options.ignore = true;
+        if (vm.count("binary")) options.binary = true;
+        if (vm.count("generic")) options.specialize = false;
+        if (vm.count("regex")) Format::parser = Format::PARSER_REGEX;
+        if (vm.count("verify")) {
+            Format::parser = Format::PARSER_VERIFY;
+            Spotlight::verify = true;
+        }
+        if (vm.count("output")) {
+            const string output = vm["output"].as<string>();
+            if (output == "json")
+                Format::output = Format::OUTPUT_JSON;
+            else if (output != "color")
+                throw runtime_error("--output is either color or json, not '" + output + "'");
+        }
         po::notify(vm);
 
+        options.lineBuffered = vm.count("line-buffered") > 0;
+        if (vm.count("stats"))
+            Stats::start();
+        Output out(STDOUT_FILENO);
+        out.setLineBuffered(options.lineBuffered);
+
+        if (vm.count("max-latency"))
+            options.maxLatency = vm["max-latency"].as<int>();
+        if (options.maxLatency < 0)
+            throw runtime_error("--max-latency cannot be negative");
+
+        if (vm.count("jobs"))
+            options.jobs = vm["jobs"].as<int>();
+        if (options.jobs < 1)
+            throw runtime_error("--jobs must be at least 1");
+
+        if (vm.count("filter"))
+            options.filter = make_shared<Filter>(vm["filter"].as<string>());
+
+        Format::parseConfiguration();
+        Formats formats;
+        shared_ptr<const Spotlight> spotlight;
+        if (vm.count("spotlight")) {
+            spotlight = make_shared<Spotlight>(vm["spotlight"].as<vector<string>>());
+            formats.setSpotlight(spotlight);
+        }
+        if (vm.count("tag-colors"))
+            formats.setTagColors(TagColors::palette());
+
+        int before = vm.count("context") ? vm["context"].as<int>() : 0;
+        int after = before;
+        if (vm.count("before"))
+            before = vm["before"].as<int>();
+        if (vm.count("after"))
+            after = vm["after"].as<int>();
+        if (before < 0 || after < 0)
+            throw runtime_error("context line counts cannot be negative");
+        if (vm.count("context") || vm.count("before") || vm.count("after")) {
+            options.context = make_shared<Context>(before, after, options.filter, spotlight);
+            options.jobs = 1;
+        }
+
+        if (vm.count("collapse")) {
+            int window = vm["collapse"].as<int>();
+            if (window < 1 || window > static_cast<int>(Collapse::MAX_WINDOW))
+                throw runtime_error("--collapse takes a window of 1 to " + to_string(Collapse::MAX_WINDOW) + " records");
+            if (options.context)
+                throw runtime_error("--collapse cannot be combined with context lines");
+            options.collapse = make_shared<Collapse>(window);
+            options.jobs = 1;
+        }
+
+        if (vm.count("rate-limit")) {
+            if (options.context)
+                throw runtime_error("--rate-limit cannot be combined with context lines");
+            options.rateLimit = make_shared<RateLimiter>();
+            for (const string& spec : vm["rate-limit"].as<vector<string>>())
+                options.rateLimit->add(spec);
+            options.jobs = 1;
+        }
+
+        if (vm.count("since") || vm.count("until")) {
+            options.range = make_shared<TimeRange>(vm.count("since") ? vm["since"].as<string>() : "",
+                                                   vm.count("until") ? vm["until"].as<string>() : "");
+            options.jobs = 1;
+        }
+
+        if (vm.count("index")) {
+            if (!vm.count("file") || vm["file"].as<vector<string>>().size() != 1)
+                throw runtime_error("--index needs a single --file");
+            const string path = vm["file"].as<vector<string>>().front();
+            MappedFile file(path);
+            if (Decompressor::detect(file.data().substr(0, Decompressor::MAGIC_SIZE)) != Decompressor::NONE)
+                throw runtime_error("--index needs an uncompressed file");
+            Index::build(formats, file, Index::path(path));
+            return finish();
+        }
+
+        if (vm.count("file") && vm["file"].as<vector<string>>().size() > 1) {
+            if (options.binary)
+                throw runtime_error("--binary cannot merge several files");
+            if (options.collapse)
+                throw runtime_error("--collapse cannot merge several files");
+            if (options.rateLimit)
+                throw runtime_error("--rate-limit cannot merge several files");
+            int window = vm.count("reorder-window") ? vm["reorder-window"].as<int>() : Merger::DEFAULT_WINDOW;
+            if (window < 0)
+                throw runtime_error("--reorder-window cannot be negative");
+            Merger(vm["file"].as<vector<string>>(), window).run(formats, options, out);
+            return finish(formats, options, out);
+        }
+
+        if (vm.count("file")) {
+            processFile(formats, options, vm["file"].as<vector<string>>().front(), out);
+            return finish(formats, options, out);
+        }
+
         if (!isatty(fileno(stdin))) {
             /*
             Stdin is coming from a pipe or redirection
             That's how we want to use this program
             */
 
-            string line;
-            Format *f = NULL;
-
-            while (getline(cin, line)) {
-                if (f == NULL) {
-                    // only need to do this once
-                    f = getFormat(line);
-                    if (f != NULL) {
-                        if (vm.count("spotlight")) {
-                            std::string line = vm["spotlight"].as<string>();
-                            f->setSpotlight(line);
-                        }
-                    }
-                }
-                if (f == NULL) {
-                    if (!ignore)
-                        cout << line << endl;
-                    continue;
-                }
+            // A redirected file can be mapped like --file, unless compressed.
+            Input input(STDIN_FILENO);
+            bool compressed = input.detect("stdin");
+            struct stat info;
+            if (!compressed && fstat(STDIN_FILENO, &info) == 0 && S_ISREG(info.st_mode) &&
+                    lseek(STDIN_FILENO, 0, SEEK_CUR) == 0) {
+                processMapped(formats, options, MappedFile(STDIN_FILENO, "stdin"), string(), out);
+                return finish(formats, options, out);
+            }
 
-                // execute parsing
-                f->parse(line);
-                if (f->valid()) {
-                    f->print();
-                }
-                else {
-                    // hum... it matched before, but not in this line
-                    // maybe something went wrong or not properly parseable
-                    // according to the expected REGEX
-                    if (!ignore)
-                        cout << line << endl;
-                }
+            if (options.binary) {
+                processBinary(formats, options, input, out);
+                return finish(formats, options, out);
             }
-            delete f;
+
+            if (options.jobs > 1)
+                processParallel(formats, options, input, out);
+            else
+                processStream(formats, options, input, out);
+            return finish(formats, options, out);
         }
         else {
             /*